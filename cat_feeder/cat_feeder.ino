@@ -1,119 +1,241 @@
 #include <Servo.h>
 #include <TimeAlarms.h>
 #include <Time.h>
-//#include <eeprom_dict.h>
+#include <eeprom_dict.h>
 #include <config_rest.h>
 #include <rest_server.h>
 #include <SPI.h>
 #include <Ethernet.h>
 #include <limits.h>
 
+#include "events.h"
 #include "feedservo.h"
+#include "http.h"
 #include "ntp.h"
+#include "saved_time.h"
 #include "soft_reset.h"
+#include "stats.h"
 
 byte ENET_MAC[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
 byte ENET_IP[] = { 192, 168, 2, 2 };
 
 #define FEED_INTERVAL_HOURS 12
 #define NUM_FEEDS 2
+#define FEED_LATE_LIMIT (10 * SECS_PER_MIN) // a feed alarm this late was passed by the clock jumping ahead
 time_t feedTime = AlarmHMS(6, 0, 0); // Feed at 6am, 6pm
 time_t feedDelta = AlarmHMS(FEED_INTERVAL_HOURS, 0, 0);
-AlarmId feedAlarm[NUM_FEEDS];
+AlarmId feedAlarm[NUM_FEEDS] = { dtINVALID_ALARM_ID, dtINVALID_ALARM_ID }; // not 0, which may be another alarm
 
 EthernetServer server(80);
 RestServer restServer = RestServer(Serial);
 
+// Clients are served by a state machine that does a bounded step for each
+// connection per loop(), so no client can hold up the alarms or the others.
+// Requests are parsed and answered for one connection at a time, there is
+// one RestServer; the W5100 buffers the others' requests meanwhile.
+#define MAX_CONNECTIONS MAX_SOCK_NUM // the W5100's sockets, one of them is NTP's
+#define CONNECTION_TIMEOUT_MS 5000   // clients slower than this, or idle this long when kept alive, are dropped
+
+enum ConnectionState {
+    connIdle,      // the slot is free
+    connWaiting,   // waiting for its turn to be parsed
+    connRouting,   // the start of its request is being read
+    connBatch,     // a batch request is being read
+    connRequest,   // the RestServer is reading its request
+    connResponse,  // the RestServer is writing its response
+    connKeepAlive, // idle between batch requests
+    connEvents,    // events are pushed to it as they happen
+    connClosing    // the response is out, stop on the next step
+};
+
+struct Connection {
+    EthernetClient client;
+    ConnectionState state;
+    unsigned long started; // millis() when its turn, its idle time or its last event started
+    int8_t ring;           // its event ring, when it has one
+};
+
+Connection connections[MAX_CONNECTIONS];
+int restServerOwner = -1; // the connection whose request is being handled, -1 if none
+
+// Clients that GET /events hold the connection open and are sent the events
+// below as server-sent events (text/event-stream), as they happen:
+//   feeding    the feeding started (value 1) or stopped (value 0)
+//   schedule   the feed time changed, value is its minute of the day
+//   time_sync  the clock was synced, value is the offset in ms it was corrected by
+//   lost       value events were dropped because the client did not keep up
+#define EVENTS_PATH "/events"
+#define MAX_EVENT_CLIENTS 2         // leaves a socket for other requests
+#define EVENT_HEARTBEAT_MS 30000UL  // something is sent this often, so a vanished client is noticed
+#define EVENT_DRAIN_BYTES 64        // read at most this much of what an event client sends in one step
+
+Events::Ring eventRings[MAX_EVENT_CLIENTS];
+
+void post_event(uint8_t type, int value) {
+    Events::Event e = { type, value, now() };
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+        if (connections[i].state == connEvents)
+            eventRings[connections[i].ring].push(e);
+}
+
+void feeding_changed() {
+    post_event(Events::feeding, FeedServo::feedingNow);
+}
+
+void start_events(Connection &c) {
+    int ring = -1;
+    for (int r = 0; r < MAX_EVENT_CLIENTS && ring < 0; r++) {
+        ring = r;
+        for (int i = 0; i < MAX_CONNECTIONS; i++)
+            if (connections[i].state == connEvents && connections[i].ring == r)
+                ring = -1;
+    }
+
+    HTTP::BufferedPrint out(c.client);
+    if (ring < 0) {
+        out.print(F("HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n"));
+        out.send();
+        c.state = connClosing;
+        return;
+    }
+
+    eventRings[ring].clear();
+    c.ring = ring;
+    out.print(F("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\nConnection: close\r\n\r\n"));
+    out.send();
+    c.state = connEvents;
+    c.started = millis();
+}
+
+void step_events(Connection &c) {
+    // the rest of the request, and anything after it, is not needed
+    for (int n = 0; n < EVENT_DRAIN_BYTES && c.client.available(); n++)
+        c.client.read();
+
+    HTTP::BufferedPrint out(c.client);
+    Events::Event e;
+    bool sent = false;
+    while (eventRings[c.ring].pop(e)) {
+        Events::print(out, e);
+        sent = true;
+    }
+    if (!sent && millis() - c.started >= EVENT_HEARTBEAT_MS) {
+        out.print(F(":\n\n")); // a comment, ignored by the client
+        sent = true;
+    }
+    if (sent) {
+        out.send();
+        c.started = millis();
+    }
+}
+
+void feed_alarm() {
+    if (timeStatus() == timeNotSet)
+        return; // the alarm is at that time of day on Jan 1 1970, not today
+    time_t scheduled = Alarm.read(Alarm.getTriggeredAlarmId());
+    time_t late = (elapsedSecsToday(now()) + SECS_PER_DAY - scheduled) % SECS_PER_DAY;
+    Stats::feedLateSecs.add(late);
+    if (late > (time_t)FEED_LATE_LIMIT) {
+        Serial.println(F("Skipped a feed the clock jumped past"));
+        return;
+    }
+    FeedServo::feed_trigger();
+}
+
 void set_feed_timer() {
     for (int i = 0; i < NUM_FEEDS; i++)
         Alarm.free(feedAlarm[i]);
 
     for (int i = 0; i < NUM_FEEDS; i++) {
-        feedAlarm[i] = Alarm.alarmRepeat((time_t)(feedTime + i*feedDelta), FeedServo::feed_trigger);
+        feedAlarm[i] = Alarm.alarmRepeat((time_t)(feedTime + i*feedDelta), feed_alarm);
         Serial.print(F("New feed alarm: "));
         Serial.print(String(i));
         Serial.print(F(" / "));
         Serial.println((int)feedAlarm[i]);
     }
+    post_event(Events::schedule, feedTime / SECS_PER_MIN);
 }
 
-struct Resource {
-    virtual int read() { return 0; };
-    virtual void write(int v) {};
-    //resource_description_t desc;
-};
+// The resources, bound to their read and write functions by the table below
+void feed_now_write(int v) { if (v) { FeedServo::feed_now(); } }
 
-struct FeedNow : Resource { virtual void write(int v) { if (v) { FeedServo::feed_now(); } } };
-
-struct ServoNeutral : Resource {
-    virtual int read() { return FeedServo::servoNeutral; }
-    virtual void write(int v) {
-        if (abs(v - FeedServo::servoNeutral) < 20) {
-            FeedServo::servoNeutral = v;
-            FeedServo::neutral();
-        }
+int servo_neutral_read() { return FeedServo::servoNeutral; }
+void servo_neutral_write(int v) {
+    if (abs(v - FeedServo::servoNeutral) < 20) {
+        FeedServo::servoNeutral = v;
+        FeedServo::neutral();
     }
-};
+}
 
-struct FeedHour : Resource {
-    virtual int read() {
-        int h = numberOfHours(feedTime);
-        return (h == 0) ? 12 : h;
-    }
-    virtual void write(int v) {
-        int m = numberOfMinutes(feedTime);
-        int h = (v == 12) ? 0 : v;
-        feedTime = AlarmHMS(h, m, 0);
-        set_feed_timer();
-    }
-};
+int feed_hour_read() {
+    int h = numberOfHours(feedTime);
+    return (h == 0) ? 12 : h;
+}
+void feed_hour_write(int v) {
+    int m = numberOfMinutes(feedTime);
+    int h = (v == 12) ? 0 : v;
+    feedTime = AlarmHMS(h, m, 0);
+    set_feed_timer();
+}
 
-struct FeedMinute : Resource {
-    virtual int read() {
-        return numberOfMinutes(feedTime);
-    }
-    virtual void write(int v) {
-        int h = numberOfHours(feedTime);
-        feedTime = AlarmHMS(h, v, 0);
-        set_feed_timer();
+int feed_minute_read() { return numberOfMinutes(feedTime); }
+void feed_minute_write(int v) {
+    int h = numberOfHours(feedTime);
+    feedTime = AlarmHMS(h, v, 0);
+    set_feed_timer();
+}
+
+void soft_reset_write(int v) {
+    if (v) {
+        SavedTime::save();
+        soft_reset();
     }
-};
+}
 
-struct SoftReset : Resource { virtual void write(int v) { if (v) soft_reset(); } };
+void stats_reset_write(int v) { if (v) Stats::reset(); }
 
-struct TimeHour : Resource { virtual int read() { return hour(); } };
-struct TimeMinute: Resource { virtual int read() { return minute(); } };
-struct TimeSecond : Resource { virtual int read() { return second(); } };
+int time_hour_read() { return hour(); }
+int time_minute_read() { return minute(); }
+int time_second_read() { return second(); }
 
+typedef int (*ResourceRead)();
+typedef void (*ResourceWrite)(int v);
 
-#define RESOURCE_COUNT 8
+// A resource as registered with the RestServer, and the functions that read and write it
+struct ResourceEntry {
+    resource_description_t desc;
+    ResourceRead read;   // NULL reads as 0
+    ResourceWrite write; // NULL ignores writes
+};
 
-Resource *resource_interactions[RESOURCE_COUNT] = {
-    new FeedNow(),
-    new ServoNeutral(),
-    new FeedHour(),
-    new FeedMinute(),
-    new SoftReset(),
-    new TimeHour(),
-    new TimeMinute(),
-    new TimeSecond()
+// Kept in flash, handle_resources() reads the functions from here and
+// setup_server() copies the descriptions out for the RestServer
+const ResourceEntry resourceTable[] PROGMEM = {
+    {{"feed_now", true, {0, 1}}, NULL, feed_now_write},
+    {{"servo_neutral", true, {0, 180}}, servo_neutral_read, servo_neutral_write},
+    {{"feed_hour", true, {1, 12}}, feed_hour_read, feed_hour_write}, // 1am/pm, 2am/pm, ..., 12am/pm
+    {{"feed_minute", true, {0, 59}}, feed_minute_read, feed_minute_write}, // minutes
+    {{"soft_reset", true, {0, 1}}, NULL, soft_reset_write},
+    {{"t_hour", false, {0, 24}}, time_hour_read, NULL},
+    {{"t_min", false, {0, 60}}, time_minute_read, NULL},
+    {{"t_sec", false, {0, 60}}, time_second_read, NULL},
+    {{"stats_reset", true, {0, 1}}, NULL, stats_reset_write} // the stats are read from /stats
 };
 
+#define RESOURCE_COUNT (int)(sizeof(resourceTable) / sizeof(resourceTable[0]))
+// /batch keeps a bit per resource in a uint16_t, this fails to compile if the table outgrows it
+// (avr-gcc 4.3 has no static_assert)
+typedef char resource_count_fits_batch_mask[RESOURCE_COUNT <= 16 ? 1 : -1];
+
 void setup_server() {
     server.begin();
 
     Serial.println(F("Started server"));
 
-    resource_description_t resources[RESOURCE_COUNT] = {
-        {"feed_now", true, {0, 1}},
-        {"servo_neutral", true, {0, 180}},
-        {"feed_hour", true, {1, 12}}, // 1am/pm, 2am/pm, ..., 12am/pm
-        {"feed_minute", true, {0, 59}}, // minutes
-        {"soft_reset", true, {0, 1}},
-        {"t_hour", false, {0, 24}},
-        {"t_min", false, {0, 60}},
-        {"t_sec", false, {0, 60}}
-    };
+    resource_description_t resources[RESOURCE_COUNT];
+    for (int i = 0; i < RESOURCE_COUNT; i++)
+        memcpy_P(&resources[i], &resourceTable[i].desc, sizeof(resource_description_t));
     restServer.register_resources(resources, RESOURCE_COUNT);
     // restServer.set_post_with_get(true);
 
@@ -122,6 +244,8 @@ void setup_server() {
 }
 
 void setup_alarm() {
+    // Sleep between alarms instead of spinning in Alarm.delay()
+    Alarm.setIdleHandler(dtIdleSleep);
     set_feed_timer();
 }
 
@@ -140,16 +264,23 @@ void setup()
     // Soft reset
     setup_soft_reset();
 
+    // Runtime stats, the free SRAM is painted to find how deep the stack goes
+    Stats::paintStack();
+    Stats::reset();
+
     // Serial port
     Serial.begin(9600);
     while (!Serial)
         ;
 
+    // Carry on from the time saved before the reset
+    SavedTime::setup(Serial);
+
     // Ethernet
     Serial.println(F("Setting up ethernet"));
     setup_ethernet();
 
-    // NTP
+    // NTP, which syncs in the background while everything else runs
     Serial.println(F("Setting up NTP"));
     NTP::setup(Serial);
 
@@ -159,6 +290,7 @@ void setup()
     // Feeder servo
     Serial.println(F("Setting up FeedServo"));
     FeedServo::setup();
+    FeedServo::onFeedingChanged = feeding_changed;
 
     // Setup the alarm
     setup_alarm();
@@ -168,30 +300,437 @@ void setup()
 
 void handle_resources(RestServer &serv) {
     for (int i = 0; i < RESOURCE_COUNT; i++) {
-        if (serv.resource_updated(i))
-            resource_interactions[i]->write(serv.resource_get_state(i));
-        if (serv.resource_requested(i))
-            serv.resource_set_state(i, resource_interactions[i]->read());
+        if (serv.resource_updated(i)) {
+            ResourceWrite write = (ResourceWrite)pgm_read_word(&resourceTable[i].write);
+            if (write)
+                write(serv.resource_get_state(i));
+        }
+        if (serv.resource_requested(i)) {
+            ResourceRead read = (ResourceRead)pgm_read_word(&resourceTable[i].read);
+            serv.resource_set_state(i, read ? read() : 0);
+        }
     }
 }
 
-void handle_server() {
-    EthernetClient client = server.available();
-    if (client) {
-        while (client.connected()) {
-            if (restServer.handle_requests(client)) {
-                handle_resources(restServer);
-                restServer.respond();
+// Batch requests read and write several resources in one request:
+//   GET /batch                       all the resources
+//   GET /batch?t_hour&t_min          the ones named
+//   GET /batch?feed_hour=7&t_hour    writes, in the order given, then reads
+//   POST /batch                      with the same pairs as the body
+// The response is one JSON object of the resources named, and an HTTP/1.1
+// connection is kept alive for the next request unless the client asks to close it.
+#define BATCH_PATH "/batch"
+#define BATCH_STEP_BYTES 64 // read at most this much of a request in one step
+
+enum BatchPart { batchQuery, batchVersion, batchHeader, batchBody };
+enum BatchHeader { headerOther, headerContentLength, headerConnection };
+
+struct BatchRequest {
+    BatchPart part;
+    char token[16];        // the resource or header name being read, then the header value
+    uint8_t tokenLen;
+    bool inValue;          // after the '=' of a pair or the ':' of a header
+    bool hasValue;
+    bool negative;
+    int value;
+    BatchHeader header;
+    uint16_t named;        // bit i for resource i, so up to 16 resources, checked at RESOURCE_COUNT
+    bool post;
+    bool keepAlive;
+    unsigned int bodyLeft; // from the Content-Length
+};
+
+BatchRequest batch;
+char requestHead[13];      // the start of the request line, read to route it
+uint8_t requestHeadLen;
+HTTP::ReplayClient restClient; // what the RestServer reads the request from
+
+int find_resource(const char *name) {
+    for (int i = 0; i < RESOURCE_COUNT; i++)
+        if (strcmp_P(name, resourceTable[i].desc.name) == 0)
+            return i;
+    return -1;
+}
+
+int read_resource(int i) {
+    ResourceRead read = (ResourceRead)pgm_read_word(&resourceTable[i].read);
+    return read ? read() : 0;
+}
+
+// Writes that the RestServer would refuse, read-only resources and values out of range, are ignored
+void write_resource(int i, int v) {
+    ResourceWrite write = (ResourceWrite)pgm_read_word(&resourceTable[i].write);
+    if (!write || !pgm_read_byte(&resourceTable[i].desc.post_enabled))
+        return;
+    if (v < (int)pgm_read_word(&resourceTable[i].desc.range.min)
+            || v > (int)pgm_read_word(&resourceTable[i].desc.range.max))
+        return;
+    write(v);
+}
+
+void batch_token_reset() {
+    batch.tokenLen = 0;
+    batch.inValue = false;
+    batch.hasValue = false;
+    batch.negative = false;
+    batch.value = 0;
+    batch.header = headerOther;
+}
+
+void batch_token_char(char ch) {
+    if (batch.tokenLen < sizeof(batch.token) - 1)
+        batch.token[batch.tokenLen++] = ch;
+    batch.token[batch.tokenLen] = 0;
+}
+
+// a name=value pair, or just a name, of the query or body
+void batch_pair_char(char ch) {
+    if (ch == '&') {
+        if (batch.tokenLen > 0) {
+            int i = find_resource(batch.token);
+            if (i >= 0) {
+                batch.named |= 1U << i;
+                if (batch.hasValue)
+                    write_resource(i, batch.negative ? -batch.value : batch.value);
             }
-            if (restServer.handle_response(client))
-                break;
         }
-        Alarm.delay(1);
-        client.stop();
+        batch_token_reset();
+    } else if (ch == '=') {
+        batch.inValue = true;
+    } else if (!batch.inValue) {
+        batch_token_char(ch);
+    } else if (ch == '-' && !batch.hasValue) {
+        batch.negative = true;
+    } else if (ch >= '0' && ch <= '9') {
+        if (batch.value > (INT_MAX - 9) / 10)
+            batch.value = INT_MAX; // held there, past the range of any resource but the widest
+        else
+            batch.value = batch.value * 10 + (ch - '0');
+        batch.hasValue = true;
+    }
+}
+
+// a header line, only the Content-Length and Connection headers matter
+void batch_header_char(char ch) {
+    if (!batch.inValue) {
+        if (ch == ':') {
+            if (strcmp_P(batch.token, PSTR("content-length")) == 0)
+                batch.header = headerContentLength;
+            else if (strcmp_P(batch.token, PSTR("connection")) == 0)
+                batch.header = headerConnection;
+            batch.inValue = true;
+            batch.tokenLen = 0;
+            batch.token[0] = 0;
+        } else {
+            batch_token_char(tolower(ch));
+        }
+    } else if (batch.header == headerContentLength) {
+        if (ch >= '0' && ch <= '9')
+            batch.bodyLeft = batch.bodyLeft * 10 + (ch - '0');
+    } else if (batch.header == headerConnection && ch != ' ') {
+        batch_token_char(tolower(ch));
+    }
+}
+
+void batch_header_end() {
+    if (batch.header == headerConnection) {
+        if (strcmp_P(batch.token, PSTR("close")) == 0)
+            batch.keepAlive = false;
+        else if (strcmp_P(batch.token, PSTR("keep-alive")) == 0)
+            batch.keepAlive = true;
+    }
+    batch_token_reset();
+}
+
+// returns true once the request has been read to its end
+bool batch_char(char ch) {
+    if (ch == '\r' && batch.part != batchBody)
+        return false;
+
+    switch (batch.part) {
+    case batchQuery:
+        if (ch == ' ') {
+            batch_pair_char('&');
+            batch.part = batchVersion;
+        } else {
+            batch_pair_char(ch);
+        }
+        break;
+    case batchVersion:
+        if (ch == '\n') {
+            batch.keepAlive = strcmp_P(batch.token, PSTR("HTTP/1.1")) == 0; // the default for 1.1
+            batch_token_reset();
+            batch.part = batchHeader;
+        } else {
+            batch_token_char(ch);
+        }
+        break;
+    case batchHeader:
+        if (ch != '\n') {
+            batch_header_char(ch);
+        } else if (batch.tokenLen > 0 || batch.inValue) {
+            batch_header_end();
+        } else if (batch.post && batch.bodyLeft > 0) {
+            batch.part = batchBody; // the blank line before the body
+        } else {
+            return true;
+        }
+        break;
+    case batchBody:
+        batch_pair_char(ch);
+        if (--batch.bodyLeft == 0) {
+            batch_pair_char('&');
+            return true;
+        }
+        break;
+    }
+    return false;
+}
+
+bool read_batch(EthernetClient &client) {
+    for (int n = 0; n < BATCH_STEP_BYTES && client.available(); n++)
+        if (batch_char(client.read()))
+            return true;
+    return false;
+}
+
+void print_batch(Print &out, const int *values) {
+    out.print('{');
+    bool first = true;
+    for (int i = 0; i < RESOURCE_COUNT; i++) {
+        if (!(batch.named & (1U << i)))
+            continue;
+        if (!first)
+            out.print(',');
+        first = false;
+        out.print('"');
+        out.print((const __FlashStringHelper *)resourceTable[i].desc.name);
+        out.print(F("\":"));
+        out.print(values[i]);
+    }
+    out.print('}');
+}
+
+void respond_batch(EthernetClient &client) {
+    if (batch.named == 0)
+        batch.named = 0xffffU >> (16 - RESOURCE_COUNT); // all of them
+
+    // read once, the body is printed twice
+    int values[RESOURCE_COUNT];
+    for (int i = 0; i < RESOURCE_COUNT; i++)
+        if (batch.named & (1U << i))
+            values[i] = read_resource(i);
+
+    HTTP::CountingPrint length;
+    print_batch(length, values);
+
+    HTTP::BufferedPrint out(client);
+    out.print(F("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "));
+    out.print(length.count);
+    if (batch.keepAlive)
+        out.print(F("\r\nConnection: keep-alive\r\n\r\n"));
+    else
+        out.print(F("\r\nConnection: close\r\n\r\n"));
+    print_batch(out, values);
+    out.send();
+}
+
+// GET /stats answers with the counters and histograms in stats.h as JSON.
+// They change as they are printed, so the response is ended by closing the
+// connection rather than given a Content-Length.
+#define STATS_PATH "/stats"
+
+void respond_stats(EthernetClient &client) {
+    HTTP::BufferedPrint out(client);
+    out.print(F("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n"));
+    Stats::print(out);
+    out.send();
+}
+
+// 1 while the start read so far matches the start of start, 2 once it is
+// all there and followed by the '?' of a query or the ' ' before the version
+uint8_t match_head(PGM_P start) {
+    uint8_t len = strlen_P(start);
+    if (requestHeadLen <= len)
+        return strncmp_P(requestHead, start, requestHeadLen) == 0 ? 1 : 0;
+    if (strncmp_P(requestHead, start, len) != 0)
+        return 0;
+    return (requestHead[len] == '?' || requestHead[len] == ' ') ? 2 : 0;
+}
+
+enum Route { routeUndecided, routeBatch, routeEvents, routeStats, routeRestServer };
+
+// Reads the start of a request, far enough to tell a batch request from one for the RestServer
+Route route_request(EthernetClient &client) {
+    while (client.available()) {
+        requestHead[requestHeadLen++] = client.read();
+        requestHead[requestHeadLen] = 0;
+
+        uint8_t get = match_head(PSTR("GET " BATCH_PATH));
+        uint8_t post = match_head(PSTR("POST " BATCH_PATH));
+        uint8_t events = match_head(PSTR("GET " EVENTS_PATH));
+        uint8_t stats = match_head(PSTR("GET " STATS_PATH));
+        if (events == 2)
+            return routeEvents;
+        if (stats == 2)
+            return routeStats;
+        if (get == 2 || post == 2) {
+            memset(&batch, 0, sizeof(batch));
+            batch.post = (post == 2);
+            batch.part = (requestHead[requestHeadLen - 1] == '?') ? batchQuery : batchVersion;
+            return routeBatch;
+        }
+        if (get == 0 && post == 0 && events == 0 && stats == 0)
+            return routeRestServer;
+    }
+    return routeUndecided;
+}
+
+void close_connection(int i) {
+    connections[i].client.stop();
+    connections[i].state = connIdle;
+    if (restServerOwner == i)
+        restServerOwner = -1;
+}
+
+// Adds a newly connected client, server.available() also returns the ones already added
+void accept_connection() {
+    EthernetClient client = server.available();
+    if (!client)
+        return;
+
+    int slot = -1;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].state == connIdle) {
+            if (slot < 0)
+                slot = i;
+        } else if (connections[i].client == client) {
+            return;
+        }
+    }
+    if (slot < 0)
+        return; // not while the sockets are all in use
+
+    connections[slot].client = client;
+    connections[slot].state = connWaiting;
+}
+
+void step_connection(int i) {
+    Connection &c = connections[i];
+    // a waiting client is not timed, the one ahead of it is; an event client is sent heartbeats
+    bool timedOut = c.state != connWaiting && c.state != connEvents
+        && millis() - c.started >= CONNECTION_TIMEOUT_MS;
+    if (c.state == connClosing || !c.client.connected() || timedOut) {
+        if (timedOut && c.state != connKeepAlive)
+            Stats::requestTimeouts++;
+        close_connection(i);
+        return;
+    }
+
+    switch (c.state) {
+    case connWaiting:
+        if (restServerOwner >= 0)
+            break;
+        restServerOwner = i;
+        requestHeadLen = 0;
+        c.state = connRouting;
+        c.started = millis();
+        // fall through
+    case connRouting:
+        switch (route_request(c.client)) {
+        case routeBatch:
+            c.state = connBatch;
+            break;
+        case routeEvents:
+            restServerOwner = -1; // the rest of its request is not read
+            start_events(c);
+            break;
+        case routeStats:
+            respond_stats(c.client);
+            Stats::requestMillis.add(millis() - c.started);
+            restServerOwner = -1;
+            c.state = connClosing;
+            break;
+        case routeRestServer:
+            restClient.client = &c.client;
+            restClient.replay = requestHead;
+            c.state = connRequest;
+            break;
+        default:
+            break;
+        }
+        break;
+    case connBatch:
+        if (read_batch(c.client)) {
+            respond_batch(c.client);
+            Stats::requestMillis.add(millis() - c.started);
+            restServerOwner = -1;
+            c.state = batch.keepAlive ? connKeepAlive : connClosing;
+            c.started = millis();
+        }
+        break;
+    case connRequest:
+        if (restServer.handle_requests(restClient)) {
+            handle_resources(restServer);
+            restServer.respond();
+            c.state = connResponse;
+        }
+        break;
+    case connResponse:
+        if (restServer.handle_response(restClient)) {
+            Stats::requestMillis.add(millis() - c.started);
+            c.state = connClosing; // give the W5100 a moment to send it
+            restServerOwner = -1;
+        }
+        break;
+    case connKeepAlive:
+        if (c.client.available())
+            c.state = connWaiting;
+        break;
+    case connEvents:
+        step_events(c);
+        break;
+    default:
+        break;
     }
 }
 
+void handle_server() {
+    accept_connection();
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+        if (connections[i].state != connIdle)
+            step_connection(i);
+}
+
+// The feed alarms are re-created once the clock is first synced, the provisional
+// time they were set from may have been well behind. Every sync is an event.
+void check_time_sync() {
+    static timeStatus_t lastStatus = timeNotSet;
+    timeStatus_t status = timeStatus();
+    if (status == timeSet && (lastStatus == timeNotSet || lastStatus == timeProvisional)) {
+        NTP::print_time(Serial);
+        set_feed_timer();
+    }
+    lastStatus = status;
+
+    static uint16_t lastSyncCount = 0;
+    if (NTP::syncCount != lastSyncCount) {
+        lastSyncCount = NTP::syncCount;
+        Stats::syncMillis.add(NTP::syncDuration);
+        post_event(Events::timeSync, constrain(NTP::lastSample.offset, -32767L, 32767L));
+    }
+
+    static uint16_t lastFailCount = 0;
+    Stats::syncFailures += (uint16_t)(NTP::failCount - lastFailCount);
+    lastFailCount = NTP::failCount;
+}
+
 void loop() {
+    unsigned long start = micros();
+    check_time_sync();
     handle_server();
+    unsigned long idle = micros();
+    Stats::loopMicros.add(idle - start);
     Alarm.delay(0); // Service any alarms
+    Stats::addIdle(micros() - idle);
 }
@@ -0,0 +1,74 @@
+#include <Print.h>
+#include <Time.h>
+
+// Events pushed to the clients that hold a connection open for them,
+// each client has a ring of its own so a slow one only loses its own events
+namespace Events {
+    enum Type { feeding, schedule, timeSync, lost };
+
+    struct Event {
+        uint8_t type;
+        int value;         // feeding: 1 started, 0 stopped; schedule: feed minute of the day;
+                           // timeSync: clock offset in ms; lost: events dropped
+        time_t time;
+    };
+
+    const uint8_t RING_SIZE = 8;
+
+    struct Ring {
+        Event events[RING_SIZE];
+        uint8_t first; // the oldest event
+        uint8_t count;
+        int lost;      // events dropped since the last one was taken
+
+        void clear() {
+            first = 0;
+            count = 0;
+            lost = 0;
+        }
+
+        // when full the oldest event is dropped
+        void push(const Event &e) {
+            if (count == RING_SIZE) {
+                first = (first + 1) % RING_SIZE;
+                count--;
+                lost++;
+            }
+            events[(first + count) % RING_SIZE] = e;
+            count++;
+        }
+
+        // a lost event comes first if any were dropped
+        bool pop(Event &e) {
+            if (lost > 0) {
+                e.type = Events::lost;
+                e.value = lost;
+                e.time = count > 0 ? events[first].time : now();
+                lost = 0;
+                return true;
+            }
+            if (count == 0)
+                return false;
+            e = events[first];
+            first = (first + 1) % RING_SIZE;
+            count--;
+            return true;
+        }
+    };
+
+    // as a server-sent event: the type, then its data as JSON
+    void print(Print &out, const Event &e) {
+        out.print(F("event: "));
+        switch (e.type) {
+        case feeding: out.print(F("feeding")); break;
+        case schedule: out.print(F("schedule")); break;
+        case timeSync: out.print(F("time_sync")); break;
+        default: out.print(F("lost")); break;
+        }
+        out.print(F("\ndata: {\"value\":"));
+        out.print(e.value);
+        out.print(F(",\"time\":"));
+        out.print(e.time);
+        out.print(F("}\n\n"));
+    }
+};
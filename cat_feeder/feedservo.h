@@ -14,6 +14,15 @@ namespace FeedServo {
 
     boolean feedingNow = false; // Servo control during feeding
     boolean cancelled = false; // Is the next feed cancelled?
+    void (*onFeedingChanged)() = NULL; // Called when feedingNow changes
+
+    // A feeding is sequenced by one repeating alarm: even steps run the
+    // servo forward, odd steps reverse it, the last step stops it.
+    struct Feeding {
+        AlarmId alarm;
+        int step;
+    };
+    Feeding feeding = { dtINVALID_ALARM_ID, 0 };
 
     void neutral() { servo.write(servoNeutral); }
     void forward() { servo.write(servoForward); }
@@ -21,21 +30,45 @@ namespace FeedServo {
     void feeding_stopped() {
         Serial.println(F("Feeding stopped."));
         feedingNow = false;
+        if (onFeedingChanged)
+            onFeedingChanged();
+    }
+
+    void feed_step(void *context) {
+        Feeding *f = (Feeding *)context;
+        if (f->step == 2*servoRepeats) {
+            neutral();
+            Alarm.free(f->alarm);
+            f->alarm = dtINVALID_ALARM_ID;
+            feeding_stopped();
+            return;
+        }
+
+        if (f->step % 2 == 0) {
+            forward();
+            Alarm.write(f->alarm, waitServoReverse);
+        } else {
+            reverse();
+            Alarm.write(f->alarm, waitLapse - waitServoReverse);
+        }
+        f->step++;
     }
 
     void feed_now() {
         if (feedingNow)
             return;
 
-        feedingNow = true;
+        feeding.step = 0;
+        feeding.alarm = Alarm.timerRepeat(1, feed_step, &feeding);
+        if (feeding.alarm == dtINVALID_ALARM_ID) {
+            Serial.println(F("No alarm free to feed"));
+            return;
+        }
 
+        feedingNow = true;
         Serial.println(F("Feeding now"));
-        for (int i = 0; i < servoRepeats; i++) {
-            Alarm.timerOnce(i*waitLapse + 1, forward);
-            Alarm.timerOnce(i*waitLapse + 1 + waitServoReverse, reverse);
-        }
-        Alarm.timerOnce(servoRepeats*waitLapse + 1, neutral);
-        Alarm.timerOnce(servoRepeats*waitLapse + 1, feeding_stopped);
+        if (onFeedingChanged)
+            onFeedingChanged();
     }
 
     void feed_trigger() {
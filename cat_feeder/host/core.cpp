@@ -0,0 +1,189 @@
+// Print, Stream and the serial port of the host build's Arduino core
+#include <Arduino.h>
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--)
+        n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(const __FlashStringHelper *ifsh) { return write(reinterpret_cast<const char *>(ifsh)); }
+size_t Print::print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+size_t Print::print(const char str[]) { return write(str); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char b, int base) { return print((unsigned long)b, base); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(unsigned int n, int base) { return print((unsigned long)n, base); }
+
+size_t Print::print(long n, int base)
+{
+    if (base == 0)
+        return write((uint8_t)n);
+    if (base == 10 && n < 0)
+        return print('-') + printNumber(-(unsigned long)n, 10);
+    return printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+    if (base == 0)
+        return write((uint8_t)n);
+    return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) { return printFloat(n, digits); }
+
+size_t Print::println(void) { return print('\r') + print('\n'); }
+size_t Print::println(const __FlashStringHelper *ifsh) { return print(ifsh) + println(); }
+size_t Print::println(const String &s) { return print(s) + println(); }
+size_t Print::println(const char c[]) { return print(c) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char b, int base) { return print(b, base) + println(); }
+size_t Print::println(int num, int base) { return print(num, base) + println(); }
+size_t Print::println(unsigned int num, int base) { return print(num, base) + println(); }
+size_t Print::println(long num, int base) { return print(num, base) + println(); }
+size_t Print::println(unsigned long num, int base) { return print(num, base) + println(); }
+size_t Print::println(double num, int digits) { return print(num, digits) + println(); }
+
+size_t Print::printNumber(unsigned long n, uint8_t base)
+{
+    char buf[8 * sizeof(long) + 1];
+    char *str = &buf[sizeof(buf) - 1];
+    *str = '\0';
+    if (base < 2)
+        base = 10;
+    do {
+        unsigned long m = n;
+        n /= base;
+        char c = m - base * n;
+        *--str = c < 10 ? c + '0' : c + 'A' - 10;
+    } while (n);
+    return write(str);
+}
+
+size_t Print::printFloat(double number, uint8_t digits)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, number);
+    return write(buf);
+}
+
+int Stream::timedRead()
+{
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if (c >= 0)
+            return c;
+        dtIdleSleep(1);
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+int Stream::timedPeek()
+{
+    unsigned long start = millis();
+    do {
+        int c = peek();
+        if (c >= 0)
+            return c;
+        dtIdleSleep(1);
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+bool Stream::findUntil(const char *target, const char *terminator)
+{
+    size_t targetLen = strlen(target);
+    size_t termLen = terminator ? strlen(terminator) : 0;
+    size_t index = 0, termIndex = 0;
+    if (targetLen == 0)
+        return true;
+    int c;
+    while ((c = timedRead()) >= 0) {
+        index = (c == target[index]) ? index + 1 : (c == target[0]);
+        if (index >= targetLen)
+            return true;
+        if (termLen > 0) {
+            termIndex = (c == terminator[termIndex]) ? termIndex + 1 : (c == terminator[0]);
+            if (termIndex >= termLen)
+                return false;
+        }
+    }
+    return false;
+}
+
+long Stream::parseInt()
+{
+    int c;
+    do {
+        c = timedPeek();
+        if (c < 0)
+            return 0;
+        if (c == '-' || isdigit(c))
+            break;
+        read();
+    } while (true);
+
+    bool negative = false;
+    long value = 0;
+    while ((c = timedPeek()) >= 0 && (c == '-' || isdigit(c))) {
+        if (c == '-')
+            negative = true;
+        else
+            value = value * 10 + c - '0';
+        read();
+    }
+    return negative ? -value : value;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+    while (count < length) {
+        int c = timedRead();
+        if (c < 0)
+            break;
+        *buffer++ = (char)c;
+        count++;
+    }
+    return count;
+}
+
+size_t Stream::readBytesUntil(char terminator, char *buffer, size_t length)
+{
+    size_t index = 0;
+    while (index < length) {
+        int c = timedRead();
+        if (c < 0 || c == terminator)
+            break;
+        *buffer++ = (char)c;
+        index++;
+    }
+    return index;
+}
+
+String Stream::readString()
+{
+    String ret;
+    int c;
+    while ((c = timedRead()) >= 0)
+        ret += (char)c;
+    return ret;
+}
+
+HardwareSerial Serial;
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    if (c != '\r') // println's line ends are Unix ones on the host
+        putchar(c);
+    return 1;
+}
+
+void HardwareSerial::flush()
+{
+    fflush(stdout);
+}
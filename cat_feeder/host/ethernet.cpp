@@ -0,0 +1,308 @@
+// The Ethernet library of the host build, on host sockets. Like the W5100 there
+// are MAX_SOCK_NUM sockets for the connections and UDP between them; a client
+// that connects while they are all in use waits in the listen backlog.
+#include <Arduino.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define WRITE_TIMEOUT_MS 1000 // real ms a write waits for a client that is not reading
+
+EthernetClass Ethernet;
+
+int EthernetClass::begin(uint8_t *)
+{
+    _localIP = IPAddress(127, 0, 0, 1);
+    return 1;
+}
+
+void EthernetClass::begin(uint8_t *, IPAddress local_ip)
+{
+    _localIP = local_ip;
+}
+
+static sockaddr_in loopback(uint16_t port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+static int socketFd(uint8_t sock)
+{
+    return sock < MAX_SOCK_NUM ? Sim::sockets[sock].fd : -1;
+}
+
+size_t EthernetClient::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+// waits, as the W5100 library does, until the client has taken it all
+size_t EthernetClient::write(const uint8_t *buf, size_t size)
+{
+    int fd = socketFd(_sock);
+    if (fd < 0)
+        return 0;
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(fd, buf + sent, size - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd p = { fd, POLLOUT, 0 };
+            if (poll(&p, 1, WRITE_TIMEOUT_MS) <= 0)
+                break;
+        } else {
+            break;
+        }
+    }
+    return sent;
+}
+
+int EthernetClient::available()
+{
+    int fd = socketFd(_sock);
+    int n = 0;
+    if (fd < 0 || ioctl(fd, FIONREAD, &n) < 0)
+        return 0;
+    return n;
+}
+
+int EthernetClient::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int EthernetClient::read(uint8_t *buf, size_t size)
+{
+    int fd = socketFd(_sock);
+    if (fd < 0)
+        return -1;
+    ssize_t n = recv(fd, buf, size, MSG_DONTWAIT);
+    return n > 0 ? n : -1;
+}
+
+int EthernetClient::peek()
+{
+    int fd = socketFd(_sock);
+    uint8_t b;
+    if (fd < 0 || recv(fd, &b, 1, MSG_DONTWAIT | MSG_PEEK) != 1)
+        return -1;
+    return b;
+}
+
+void EthernetClient::stop()
+{
+    if (socketFd(_sock) >= 0)
+        Sim::closeSocket(_sock);
+    _sock = MAX_SOCK_NUM;
+}
+
+// until the client has closed its end and everything it sent has been read
+uint8_t EthernetClient::connected()
+{
+    int fd = socketFd(_sock);
+    if (fd < 0)
+        return 0;
+    if (available() > 0)
+        return 1;
+    uint8_t b;
+    ssize_t n = recv(fd, &b, 1, MSG_DONTWAIT | MSG_PEEK);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// the listening sockets, by the sketch's port
+static struct {
+    uint16_t port;
+    int fd;
+} listeners[MAX_SOCK_NUM];
+
+static int listenerFd(uint16_t port)
+{
+    for (int i = 0; i < MAX_SOCK_NUM; i++)
+        if (listeners[i].fd > 0 && listeners[i].port == port)
+            return listeners[i].fd;
+    return -1;
+}
+
+void EthernetServer::begin()
+{
+    if (listenerFd(_port) >= 0)
+        return;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr = loopback(Sim::options.port ? Sim::options.port : _port + 8000);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "cannot listen on port %u: %s\n", ntohs(addr.sin_port), strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < MAX_SOCK_NUM; i++) {
+        if (listeners[i].fd <= 0) {
+            listeners[i].port = _port;
+            listeners[i].fd = fd;
+            break;
+        }
+    }
+    Sim::watch(fd);
+}
+
+void EthernetServer::accept()
+{
+    int listenFd = listenerFd(_port);
+    if (listenFd < 0)
+        return;
+    for (;;) {
+        int free = 0;
+        for (int sock = 0; sock < MAX_SOCK_NUM; sock++)
+            if (Sim::sockets[sock].fd < 0)
+                free++;
+        if (free == 0)
+            return;
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        int on = 1; // the W5100 sends each write as it comes
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        Sim::openSocket(fd, false, _port);
+    }
+}
+
+// a connection to this server with something to read, as the W5100 library does
+EthernetClient EthernetServer::available()
+{
+    accept();
+    for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+        if (Sim::sockets[sock].fd < 0 || Sim::sockets[sock].udp || Sim::sockets[sock].port != _port)
+            continue;
+        EthernetClient client(sock);
+        if (client.available())
+            return client;
+    }
+    return EthernetClient(MAX_SOCK_NUM);
+}
+
+size_t EthernetServer::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+size_t EthernetServer::write(const uint8_t *buf, size_t size)
+{
+    accept();
+    size_t n = 0;
+    for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+        if (Sim::sockets[sock].fd < 0 || Sim::sockets[sock].udp || Sim::sockets[sock].port != _port)
+            continue;
+        EthernetClient client(sock);
+        n += client.write(buf, size);
+    }
+    return n;
+}
+
+uint8_t EthernetUDP::begin(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = loopback(0); // any port, the replies come back to it
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    _sock = Sim::openSocket(fd, true, port);
+    if (_sock == MAX_SOCK_NUM) {
+        close(fd);
+        return 0;
+    }
+    return 1;
+}
+
+void EthernetUDP::stop()
+{
+    if (socketFd(_sock) >= 0)
+        Sim::closeSocket(_sock);
+    _sock = MAX_SOCK_NUM;
+}
+
+int EthernetUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+    _txIP = ip;
+    _txPort = port;
+    _txLen = 0;
+    return 1;
+}
+
+size_t EthernetUDP::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+size_t EthernetUDP::write(const uint8_t *buffer, size_t size)
+{
+    if (size > sizeof(_tx) - _txLen)
+        size = sizeof(_tx) - _txLen;
+    memcpy(_tx + _txLen, buffer, size);
+    _txLen += size;
+    return size;
+}
+
+// sent as the W5100 would, what there is no simulated server for is lost on the way
+int EthernetUDP::endPacket()
+{
+    int fd = socketFd(_sock);
+    if (fd < 0)
+        return 0;
+    if (_txPort == 123) {
+        sockaddr_in addr = loopback(Sim::timeServerPort());
+        sendto(fd, _tx, _txLen, 0, (sockaddr *)&addr, sizeof(addr));
+    }
+    return 1;
+}
+
+int EthernetUDP::parsePacket()
+{
+    _rxLen = _rxPos = 0;
+    int fd = socketFd(_sock);
+    if (fd < 0)
+        return 0;
+    Sim::serviceTimeServer();
+    ssize_t n = recv(fd, _rx, sizeof(_rx), MSG_DONTWAIT);
+    if (n <= 0)
+        return 0;
+    _rxLen = n;
+    _remoteIP = IPAddress(127, 0, 0, 1);
+    _remotePort = 123;
+    return n;
+}
+
+int EthernetUDP::read()
+{
+    return _rxPos < _rxLen ? _rx[_rxPos++] : -1;
+}
+
+int EthernetUDP::read(unsigned char *buffer, size_t len)
+{
+    int n = _rxLen - _rxPos;
+    if (n <= 0)
+        return -1;
+    if ((size_t)n > len)
+        n = len;
+    memcpy(buffer, _rx + _rxPos, n);
+    _rxPos += n;
+    return n;
+}
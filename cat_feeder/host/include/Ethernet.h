@@ -0,0 +1,69 @@
+// The Ethernet library for the host build. Its sockets are host sockets on the
+// loopback interface, as many as the W5100 has, see ethernet.cpp.
+#ifndef ethernet_h
+#define ethernet_h
+
+#include <Arduino.h>
+#include "Client.h"
+#include "Server.h"
+#include "IPAddress.h"
+
+#define MAX_SOCK_NUM 4
+
+class EthernetClass {
+ public:
+    int begin(uint8_t *mac);
+    void begin(uint8_t *mac, IPAddress local_ip);
+    int maintain() { return 0; }
+    IPAddress localIP() { return _localIP; }
+
+ private:
+    IPAddress _localIP;
+};
+
+extern EthernetClass Ethernet;
+
+class EthernetClient : public Client {
+ public:
+    EthernetClient() : _sock(MAX_SOCK_NUM) {}
+    EthernetClient(uint8_t sock) : _sock(sock) {}
+
+    // outgoing connections are not simulated, they fail
+    virtual int connect(IPAddress, uint16_t) { return 0; }
+    virtual int connect(const char *, uint16_t) { return 0; }
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush() {}
+    virtual void stop();
+    virtual uint8_t connected();
+    virtual operator bool() { return _sock != MAX_SOCK_NUM; }
+    virtual bool operator==(const EthernetClient &rhs) const { return _sock == rhs._sock && _sock != MAX_SOCK_NUM; }
+    virtual bool operator!=(const EthernetClient &rhs) const { return !(*this == rhs); }
+
+    using Print::write;
+
+ private:
+    uint8_t _sock;
+};
+
+class EthernetServer : public Server {
+ public:
+    EthernetServer(uint16_t port) : _port(port) {}
+
+    EthernetClient available();
+    virtual void begin();
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buf, size_t size);
+
+    using Print::write;
+
+ private:
+    uint16_t _port;
+    void accept();
+};
+
+#endif
@@ -0,0 +1,50 @@
+// UDP for the host build. Packets to port 123 of any address reach the
+// simulation's time server, others are dropped.
+#ifndef ethernetudp_h
+#define ethernetudp_h
+
+#include <Udp.h>
+#include <Ethernet.h>
+
+#define UDP_TX_PACKET_MAX_SIZE 24
+
+class EthernetUDP : public UDP {
+ public:
+    EthernetUDP() : _sock(MAX_SOCK_NUM), _txLen(0), _rxLen(0), _rxPos(0), _remotePort(0) {}
+
+    virtual uint8_t begin(uint16_t port);
+    virtual void stop();
+
+    virtual int beginPacket(IPAddress ip, uint16_t port);
+    virtual int beginPacket(const char *, uint16_t) { return 0; }
+    virtual int endPacket();
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+
+    virtual int parsePacket();
+    virtual int available() { return _rxLen - _rxPos; }
+    virtual int read();
+    virtual int read(unsigned char *buffer, size_t len);
+    virtual int read(char *buffer, size_t len) { return read((unsigned char *)buffer, len); }
+    virtual int peek() { return _rxPos < _rxLen ? _rx[_rxPos] : -1; }
+    virtual void flush() { _rxPos = _rxLen; }
+
+    virtual IPAddress remoteIP() { return _remoteIP; }
+    virtual uint16_t remotePort() { return _remotePort; }
+
+    using Print::write;
+
+ private:
+    uint8_t _sock;
+    uint8_t _tx[576];
+    size_t _txLen;
+    uint8_t _rx[576];
+    int _rxLen;
+    int _rxPos;
+    IPAddress _txIP;
+    uint16_t _txPort;
+    IPAddress _remoteIP;
+    uint16_t _remotePort;
+};
+
+#endif
@@ -0,0 +1,22 @@
+// The serial port is the host build's standard output, nothing is ever received
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Stream.h"
+
+class HardwareSerial : public Stream {
+ public:
+    void begin(unsigned long) {}
+    void end() {}
+    virtual int available() { return 0; }
+    virtual int peek() { return -1; }
+    virtual int read() { return -1; }
+    virtual void flush();
+    virtual size_t write(uint8_t c);
+    using Print::write;
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
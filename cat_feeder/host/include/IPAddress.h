@@ -0,0 +1,28 @@
+// Arduino's IPAddress for the host build
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+#include <string.h>
+
+class IPAddress {
+ public:
+    IPAddress() { memset(_address, 0, sizeof(_address)); }
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth) {
+        _address[0] = first;
+        _address[1] = second;
+        _address[2] = third;
+        _address[3] = fourth;
+    }
+    IPAddress(const uint8_t *address) { memcpy(_address, address, sizeof(_address)); }
+
+    uint8_t operator[](int index) const { return _address[index]; }
+    uint8_t &operator[](int index) { return _address[index]; }
+    bool operator==(const IPAddress &addr) const { return memcmp(addr._address, _address, sizeof(_address)) == 0; }
+    bool operator!=(const IPAddress &addr) const { return !(*this == addr); }
+
+ private:
+    uint8_t _address[4];
+};
+
+#endif
@@ -0,0 +1,5 @@
+// The W5100 is not on an SPI bus in the host build
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#endif
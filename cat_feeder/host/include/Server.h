@@ -0,0 +1,12 @@
+// Arduino's Server for the host build
+#ifndef server_h
+#define server_h
+
+#include "Print.h"
+
+class Server : public Print {
+ public:
+    virtual void begin() = 0;
+};
+
+#endif
@@ -0,0 +1,24 @@
+// A Servo that records what it is told, for sim.cpp to report on
+#ifndef Servo_h
+#define Servo_h
+
+#include <stdint.h>
+
+class Servo {
+ public:
+    Servo() : pin(0), angle(90) {}
+
+    uint8_t attach(int pin) { this->pin = pin; return 0; }
+    uint8_t attach(int pin, int, int) { return attach(pin); } // the pulse widths are not simulated
+    void detach() { pin = 0; }
+    void write(int value);
+    void writeMicroseconds(int value) { write((value - 544) * 180 / (2400 - 544)); }
+    int read() { return angle; }
+    bool attached() { return pin != 0; }
+
+ private:
+    int pin;
+    int angle;
+};
+
+#endif
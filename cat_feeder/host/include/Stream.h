@@ -0,0 +1,32 @@
+// Arduino's Stream for the host build, reads time out on the simulated clock
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print {
+ public:
+    Stream() : _timeout(1000) {}
+
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+    bool find(const char *target) { return findUntil(target, NULL); }
+    bool findUntil(const char *target, const char *terminator);
+    long parseInt();
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytesUntil(char terminator, char *buffer, size_t length);
+    String readString();
+
+ protected:
+    unsigned long _timeout; // ms to wait for a character
+
+    int timedRead();
+    int timedPeek();
+};
+
+#endif
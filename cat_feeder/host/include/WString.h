@@ -0,0 +1,98 @@
+// Arduino's String for the host build, on std::string
+#ifndef String_class_h
+#define String_class_h
+
+#include <string>
+
+class __FlashStringHelper;
+
+class String {
+ public:
+    String(const char *cstr = "") : s(cstr ? cstr : "") {}
+    String(const __FlashStringHelper *str) : s(reinterpret_cast<const char *>(str)) {}
+    explicit String(char c) : s(1, c) {}
+    explicit String(unsigned char value, unsigned char base = 10) { fromNumber(value, base); }
+    explicit String(int value, unsigned char base = 10) { fromNumber(value, base); }
+    explicit String(unsigned int value, unsigned char base = 10) { fromNumber(value, base); }
+    explicit String(long value, unsigned char base = 10) { fromNumber(value, base); }
+    explicit String(unsigned long value, unsigned char base = 10) { fromNumber(value, base); }
+
+    unsigned int length() const { return s.length(); }
+    const char *c_str() const { return s.c_str(); }
+    unsigned char reserve(unsigned int size) { s.reserve(size); return 1; }
+
+    char charAt(unsigned int index) const { return index < s.length() ? s[index] : 0; }
+    char operator[](unsigned int index) const { return charAt(index); }
+    char &operator[](unsigned int index) { return s[index]; }
+
+    String &operator+=(const String &rhs) { s += rhs.s; return *this; }
+    String &operator+=(const char *cstr) { s += cstr; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    unsigned char concat(const String &str) { s += str.s; return 1; }
+    unsigned char concat(const char *cstr) { s += cstr; return 1; }
+    unsigned char concat(char c) { s += c; return 1; }
+
+    unsigned char equals(const String &str) const { return s == str.s; }
+    unsigned char equals(const char *cstr) const { return s == cstr; }
+    unsigned char operator==(const String &rhs) const { return equals(rhs); }
+    unsigned char operator==(const char *cstr) const { return equals(cstr); }
+    unsigned char operator!=(const String &rhs) const { return !equals(rhs); }
+    unsigned char operator!=(const char *cstr) const { return !equals(cstr); }
+    unsigned char startsWith(const String &prefix) const { return s.compare(0, prefix.s.length(), prefix.s) == 0; }
+    unsigned char endsWith(const String &suffix) const {
+        return s.length() >= suffix.s.length()
+            && s.compare(s.length() - suffix.s.length(), suffix.s.length(), suffix.s) == 0;
+    }
+
+    int indexOf(char c, unsigned int from = 0) const { return find(s.find(c, from)); }
+    int indexOf(const String &str, unsigned int from = 0) const { return find(s.find(str.s, from)); }
+    String substring(unsigned int left) const { return substring(left, s.length()); }
+    String substring(unsigned int left, unsigned int right) const {
+        if (left > right) { unsigned int t = left; left = right; right = t; }
+        if (left > s.length())
+            return String();
+        return String(s.substr(left, right - left).c_str());
+    }
+
+    long toInt() const { return atol(s.c_str()); }
+    void toLowerCase() { for (size_t i = 0; i < s.length(); i++) s[i] = tolower(s[i]); }
+    void toUpperCase() { for (size_t i = 0; i < s.length(); i++) s[i] = toupper(s[i]); }
+    void trim() {
+        size_t first = s.find_first_not_of(" \t\r\n");
+        size_t last = s.find_last_not_of(" \t\r\n");
+        s = (first == std::string::npos) ? std::string() : s.substr(first, last - first + 1);
+    }
+
+    friend String operator+(const String &lhs, const String &rhs) { String r(lhs); r += rhs; return r; }
+    friend String operator+(const String &lhs, const char *rhs) { String r(lhs); r += rhs; return r; }
+
+ private:
+    std::string s;
+
+    static int find(size_t pos) { return pos == std::string::npos ? -1 : (int)pos; }
+
+    void fromNumber(unsigned long value, unsigned char base, bool negative = false) {
+        char buf[8 * sizeof(long) + 2];
+        char *p = buf + sizeof(buf) - 1;
+        *p = 0;
+        do {
+            int digit = value % base;
+            *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+            value /= base;
+        } while (value);
+        if (negative)
+            *--p = '-';
+        s = p;
+    }
+    void fromNumber(long value, unsigned char base) {
+        if (value < 0 && base == 10)
+            fromNumber((unsigned long)-value, base, true);
+        else
+            fromNumber((unsigned long)value, base);
+    }
+    void fromNumber(int value, unsigned char base) { fromNumber((long)value, base); }
+    void fromNumber(unsigned int value, unsigned char base) { fromNumber((unsigned long)value, base); }
+    void fromNumber(unsigned char value, unsigned char base) { fromNumber((unsigned long)value, base); }
+};
+
+#endif
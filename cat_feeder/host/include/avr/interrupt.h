@@ -0,0 +1,8 @@
+// Nothing interrupts the host build's loop()
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+#define cli()
+#define sei()
+
+#endif
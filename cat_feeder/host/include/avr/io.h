@@ -0,0 +1,11 @@
+// The registers the sketch and its libraries touch, as the ATmega328P has them
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+#define E2END 0x3FF // the last EEPROM address
+
+extern uint8_t MCUSR;
+
+#endif
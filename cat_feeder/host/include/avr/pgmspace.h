@@ -0,0 +1,24 @@
+// Flash is ordinary memory on the host. The reads dereference the pointer they
+// are given, so pointers kept in PROGMEM tables stay whole rather than 16 bits.
+#ifndef __PGMSPACE_H_
+#define __PGMSPACE_H_
+
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(addr))
+#define pgm_read_word(addr) (*(addr))
+#define pgm_read_dword(addr) (*(addr))
+
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strlen_P strlen
+
+#endif
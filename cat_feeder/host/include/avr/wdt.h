@@ -0,0 +1,13 @@
+// There is no watchdog on the host, enabling it resets by ending the simulation
+#ifndef _AVR_WDT_H_
+#define _AVR_WDT_H_
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define WDTO_15MS 0
+
+inline void wdt_disable() {}
+void wdt_enable(uint8_t timeout);
+
+#endif
@@ -0,0 +1,385 @@
+// Load generator for the host build of the sketch, see sim.cpp. It keeps
+// --clients keep-alive connections busy with batch requests, and every
+// --feed-every seconds it moves the feed time to the coming minute so that
+// feedings run under load. It also listens on /events. At the end it reports
+// requests per second and the latency percentiles, then the firmware's own
+// view from /stats, including how late the feed alarms ran.
+//
+//   loadgen [--host ADDR] [--port N] [--clients N] [--seconds N]
+//           [--feed-every SECS] [--no-events] [--get PATH]...
+//
+// --get adds a path to the ones requested, e.g. one for the RestServer.
+// Each client holds one of the W5100's sockets and NTP holds another, so more
+// than two clients, or three without --no-events, wait for one to be freed.
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_TIMEOUT_SECS 10
+
+struct Options {
+    const char *host;
+    int port;
+    int clients;
+    int seconds;
+    int feedEvery;
+    bool events;
+    std::vector<std::string> paths;
+};
+Options options = { "127.0.0.1", 8080, 2, 30, 90, true, std::vector<std::string>() };
+
+double realSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double deadline;
+
+// A connection to the sketch, with what has been read of it but not used yet
+struct Connection {
+    int fd;
+    std::string buf;
+
+    Connection() : fd(-1) {}
+    ~Connection() { close(); }
+
+    bool open()
+    {
+        close();
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host, &addr.sin_addr);
+        timeval timeout = { READ_TIMEOUT_SECS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        buf.clear();
+    }
+
+    bool send(const std::string &s)
+    {
+        size_t sent = 0;
+        while (sent < s.size()) {
+            ssize_t n = ::send(fd, s.data() + sent, s.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    // more into buf, false at the end of the stream or on a timeout
+    bool fill()
+    {
+        char chunk[1024];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return false;
+        buf.append(chunk, n);
+        return true;
+    }
+
+    bool readLine(std::string &line)
+    {
+        size_t end;
+        while ((end = buf.find('\n')) == std::string::npos)
+            if (!fill())
+                return false;
+        line = buf.substr(0, end);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        buf.erase(0, end + 1);
+        return true;
+    }
+};
+
+struct Response {
+    int status;
+    std::string body;
+    bool close; // the sketch closes the connection after it
+};
+
+bool readHead(Connection &c, Response &r, long &length)
+{
+    std::string line;
+    if (!c.readLine(line) || sscanf(line.c_str(), "HTTP/%*d.%*d %d", &r.status) != 1)
+        return false;
+    r.close = line.compare(0, 8, "HTTP/1.0") == 0;
+    length = -1;
+    while (c.readLine(line) && !line.empty()) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = line.substr(0, colon);
+        const char *value = line.c_str() + colon + 1;
+        while (*value == ' ')
+            value++;
+        if (strcasecmp(name.c_str(), "content-length") == 0)
+            length = atol(value);
+        else if (strcasecmp(name.c_str(), "connection") == 0)
+            r.close = strcasecmp(value, "close") == 0;
+    }
+    return line.empty();
+}
+
+// sends a GET and reads the response, false if the connection failed
+bool get(Connection &c, const std::string &path, Response &r)
+{
+    long length;
+    if (!c.send("GET " + path + " HTTP/1.1\r\nHost: feeder\r\n\r\n") || !readHead(c, r, length))
+        return false;
+    if (length < 0) {
+        r.close = true; // the body ends with the connection
+        while (c.fill())
+            ;
+        r.body = c.buf;
+    } else {
+        while ((long)c.buf.size() < length)
+            if (!c.fill())
+                return false;
+        r.body = c.buf.substr(0, length);
+        c.buf.erase(0, length);
+    }
+    return true;
+}
+
+// the number after "key": in s, from pos on
+long jsonNumber(const std::string &s, const char *key, size_t pos = 0)
+{
+    size_t at = s.find(std::string("\"") + key + "\":", pos);
+    return at == std::string::npos ? -1 : atol(s.c_str() + at + strlen(key) + 3);
+}
+
+size_t jsonFind(const std::string &s, const char *key)
+{
+    size_t at = s.find(std::string("\"") + key + "\":");
+    return at == std::string::npos ? s.size() : at;
+}
+
+struct Worker {
+    std::vector<long> latencyUs;
+    unsigned long failed;
+    unsigned long notOk;
+    unsigned long feedsScheduled;
+
+    Worker() : failed(0), notOk(0), feedsScheduled(0) {}
+
+    bool request(Connection &c, const std::string &path, Response &r)
+    {
+        if (c.fd < 0 && !c.open()) {
+            failed++;
+            usleep(10000);
+            return false;
+        }
+        double start = realSeconds();
+        if (!get(c, path, r)) {
+            failed++;
+            c.close();
+            return false;
+        }
+        latencyUs.push_back((long)((realSeconds() - start) * 1e6));
+        if (r.status != 200)
+            notOk++;
+        if (r.close)
+            c.close();
+        return true;
+    }
+
+    // the feed time is moved to the next minute at least 30 seconds away
+    void scheduleFeed(Connection &c)
+    {
+        Response r;
+        if (!request(c, "/batch?t_hour&t_min&t_sec", r) || r.status != 200)
+            return;
+        long minutes = jsonNumber(r.body, "t_hour") * 60 + jsonNumber(r.body, "t_min")
+            + (jsonNumber(r.body, "t_sec") < 30 ? 1 : 2);
+        long hour = (minutes / 60) % 12;
+        char path[64];
+        snprintf(path, sizeof(path), "/batch?feed_hour=%ld&feed_minute=%ld",
+            hour == 0 ? 12 : hour, minutes % 60);
+        if (request(c, path, r) && r.status == 200)
+            feedsScheduled++;
+    }
+
+    void run(int index)
+    {
+        Connection c;
+        Response r;
+        double nextFeed = realSeconds();
+        for (size_t n = index; realSeconds() < deadline; n++) {
+            if (index == 0 && options.feedEvery > 0 && realSeconds() >= nextFeed) {
+                scheduleFeed(c);
+                nextFeed += options.feedEvery;
+            }
+            request(c, options.paths[n % options.paths.size()], r);
+        }
+    }
+};
+
+struct EventListener {
+    unsigned long feeding, schedule, timeSync, lost;
+    int status;
+
+    EventListener() : feeding(0), schedule(0), timeSync(0), lost(0), status(0) {}
+
+    void run()
+    {
+        Connection c;
+        Response r;
+        long length;
+        if (!c.open() || !c.send("GET /events HTTP/1.1\r\nHost: feeder\r\n\r\n") || !readHead(c, r, length))
+            return;
+        status = r.status;
+        timeval timeout = { 1, 0 }; // to notice the deadline
+        setsockopt(c.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string line;
+        while (realSeconds() < deadline) {
+            errno = 0;
+            if (!c.readLine(line)) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    return;
+                continue;
+            }
+            if (line == "event: feeding")
+                feeding++;
+            else if (line == "event: schedule")
+                schedule++;
+            else if (line == "event: time_sync")
+                timeSync++;
+            else if (line == "event: lost")
+                lost++;
+        }
+    }
+};
+
+void usage()
+{
+    fprintf(stderr, "usage: loadgen [--host ADDR] [--port N] [--clients N] [--seconds N]\n"
+        "               [--feed-every SECS] [--no-events] [--get PATH]...\n");
+    exit(2);
+}
+
+void parseOptions(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--no-events") == 0) {
+            options.events = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        const char *value = argv[++i];
+        if (strcmp(arg, "--host") == 0)
+            options.host = value;
+        else if (strcmp(arg, "--port") == 0)
+            options.port = atoi(value);
+        else if (strcmp(arg, "--clients") == 0)
+            options.clients = atoi(value);
+        else if (strcmp(arg, "--seconds") == 0)
+            options.seconds = atoi(value);
+        else if (strcmp(arg, "--feed-every") == 0)
+            options.feedEvery = atoi(value);
+        else if (strcmp(arg, "--get") == 0)
+            options.paths.push_back(value);
+        else
+            usage();
+    }
+    if (options.clients < 1 || options.seconds < 1)
+        usage();
+    options.paths.push_back("/batch");
+    options.paths.push_back("/batch?t_hour&t_min&t_sec");
+}
+
+double percentile(const std::vector<long> &sorted, double p)
+{
+    size_t i = (size_t)(p / 100 * sorted.size());
+    return sorted[std::min(i, sorted.size() - 1)] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    parseOptions(argc, argv);
+
+    double start = realSeconds();
+    deadline = start + options.seconds;
+    std::vector<Worker> workers(options.clients);
+    EventListener listener;
+    std::vector<std::thread> threads;
+    if (options.events)
+        threads.push_back(std::thread(&EventListener::run, &listener));
+    for (int i = 0; i < options.clients; i++)
+        threads.push_back(std::thread(&Worker::run, &workers[i], i));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    double elapsed = realSeconds() - start;
+
+    std::vector<long> latency;
+    unsigned long failed = 0, notOk = 0, feedsScheduled = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        latency.insert(latency.end(), workers[i].latencyUs.begin(), workers[i].latencyUs.end());
+        failed += workers[i].failed;
+        notOk += workers[i].notOk;
+        feedsScheduled += workers[i].feedsScheduled;
+    }
+    std::sort(latency.begin(), latency.end());
+
+    printf("requests %lu in %.1f s, %.1f per second, %lu failed, %lu not 200\n",
+        (unsigned long)latency.size(), elapsed, latency.size() / elapsed, failed, notOk);
+    if (!latency.empty())
+        printf("latency ms: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+            percentile(latency, 50), percentile(latency, 90), percentile(latency, 99),
+            percentile(latency, 99.9), latency.back() / 1000.0);
+    printf("feed times set %lu", feedsScheduled);
+    if (options.events)
+        printf(", events (status %d): feeding %lu schedule %lu time_sync %lu lost %lu",
+            listener.status, listener.feeding, listener.schedule, listener.timeSync, listener.lost);
+    printf("\n");
+
+    // the firmware's own view, once the sockets above have been let go
+    usleep(200000);
+    Connection c;
+    Response r;
+    if (!c.open() || !get(c, "/stats", r) || r.status != 200) {
+        printf("no stats\n");
+        return 1;
+    }
+    const std::string &s = r.body;
+    size_t late = jsonFind(s, "feed_late_secs");
+    size_t request = jsonFind(s, "request_ms");
+    printf("firmware: feed alarms %ld, the latest %ld s late; requests %ld, the slowest %ld ms, %ld timed out\n",
+        jsonNumber(s, "count", late), jsonNumber(s, "max", late),
+        jsonNumber(s, "count", request), jsonNumber(s, "max", request), jsonNumber(s, "request_timeouts"));
+    printf("stats %s\n", s.c_str());
+    return 0;
+}
@@ -0,0 +1,9 @@
+// Settings of the RestServer stand-in, see rest_server.h
+#ifndef config_rest_h
+#define config_rest_h
+
+#define NAME_LENGTH 16    // longest resource name, with its NUL
+#define MAX_RESOURCES 16  // most resources that can be registered
+#define LINE_LENGTH 64    // longest request line kept, the rest of it is ignored
+
+#endif
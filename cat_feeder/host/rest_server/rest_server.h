@@ -0,0 +1,166 @@
+// A stand-in for the RestServer library (the libraries/rest_server submodule) so the
+// host build works from a clean checkout. It has the calls the sketch makes and
+// answers the same kind of requests:
+//   GET /name                 the resource's state
+//   GET /name/value           sets it, if it takes writes and value is in its range
+//   GET /name1/name2/value    any number of them, in one request
+//   GET / or GET /all         every resource
+// with a JSON object of the resources named, and closes the connection.
+#ifndef rest_server_h
+#define rest_server_h
+
+#include <Arduino.h>
+#include <Client.h>
+#include "config_rest.h"
+
+typedef struct {
+    int min;
+    int max;
+} resource_range_t;
+
+typedef struct {
+    char name[NAME_LENGTH];
+    bool post_enabled;
+    resource_range_t range;
+} resource_description_t;
+
+enum { SERVER_READY, SERVER_READING, SERVER_PROCESSING, SERVER_RESPONDING };
+
+class RestServer {
+    Print &log;
+    resource_description_t resources[MAX_RESOURCES];
+    int count;
+    int state[MAX_RESOURCES];
+    bool requested[MAX_RESOURCES];
+    bool updated[MAX_RESOURCES];
+    int serverState;
+    char line[LINE_LENGTH];  // the request line, NUL terminated
+    int lineLen;
+    bool lineDone;
+    int blankRun;            // line ends since the last other byte, 2 ends the headers
+
+    int find(const char *name) {
+        for (int i = 0; i < count; i++) {
+            if (strcmp(name, resources[i].name) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    // marks the resources named in the path of the request line
+    void parse() {
+        for (int i = 0; i < count; i++)
+            requested[i] = updated[i] = false;
+
+        char *path = strchr(line, ' ');
+        if (!path)
+            return;
+        path++;
+        char *end = strpbrk(path, " ?");
+        if (end)
+            *end = 0;
+        if (strcmp(path, "/") == 0 || strcmp(path, "/all") == 0) {
+            for (int i = 0; i < count; i++)
+                requested[i] = true;
+            return;
+        }
+
+        int last = -1; // the resource named just before, a number after it is its new value
+        for (char *name = strtok(path, "/"); name; name = strtok(NULL, "/")) {
+            char *digits;
+            long v = strtol(name, &digits, 10);
+            if (last >= 0 && *name && !*digits) {
+                if (resources[last].post_enabled
+                        && v >= resources[last].range.min && v <= resources[last].range.max) {
+                    state[last] = v;
+                    updated[last] = true;
+                }
+                last = -1;
+            } else {
+                last = find(name);
+                if (last >= 0)
+                    requested[last] = true;
+            }
+        }
+    }
+
+ public:
+    RestServer(Print &logTo)
+        : log(logTo), count(0), serverState(SERVER_READY), lineLen(0), lineDone(false), blankRun(0) {}
+
+    void register_resources(resource_description_t *list, int n) {
+        count = (n < MAX_RESOURCES) ? n : MAX_RESOURCES;
+        for (int i = 0; i < count; i++) {
+            resources[i] = list[i];
+            state[i] = 0;
+            requested[i] = updated[i] = false;
+        }
+    }
+
+    int get_server_state() { return serverState; }
+
+    // reads what the client has sent, true once the whole request head is in
+    bool handle_requests(Client &client) {
+        if (serverState == SERVER_READY)
+            serverState = SERVER_READING;
+        while (serverState == SERVER_READING && client.available()) {
+            char ch = client.read();
+            if (!lineDone) {
+                if (ch == '\n') {
+                    lineDone = true;
+                    blankRun = 1;
+                } else if (ch != '\r' && lineLen < LINE_LENGTH - 1) {
+                    line[lineLen++] = ch;
+                }
+            } else if (ch == '\n') {
+                if (++blankRun == 2) {
+                    line[lineLen] = 0;
+                    parse();
+                    serverState = SERVER_PROCESSING;
+                }
+            } else if (ch != '\r') {
+                blankRun = 0;
+            }
+        }
+        return serverState == SERVER_PROCESSING;
+    }
+
+    bool resource_updated(int i) { return updated[i]; }
+    bool resource_requested(int i) { return requested[i]; }
+    int resource_get_state(int i) { return state[i]; }
+    void resource_set_state(int i, int v) { state[i] = v; }
+
+    // the sketch has read and written the resources, the response can go out
+    void respond() {
+        if (serverState == SERVER_PROCESSING)
+            serverState = SERVER_RESPONDING;
+    }
+
+    // sends the response, true once it has gone and the server is ready for the next request
+    bool handle_response(Client &client) {
+        if (serverState != SERVER_RESPONDING)
+            return false;
+        client.print(F("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n{"));
+        bool first = true;
+        for (int i = 0; i < count; i++) {
+            if (!requested[i])
+                continue;
+            if (!first)
+                client.print(',');
+            first = false;
+            client.print('"');
+            client.print(resources[i].name);
+            client.print(F("\":"));
+            client.print(state[i]);
+        }
+        client.print('}');
+
+        serverState = SERVER_READY;
+        lineLen = 0;
+        lineDone = false;
+        blankRun = 0;
+        return true;
+    }
+};
+
+#endif
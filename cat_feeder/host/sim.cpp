@@ -0,0 +1,398 @@
+// Runs the sketch on the host: the simulated clock behind millis(), the W5100's
+// sockets, a time server, the EEPROM and the servo, and a report of what was
+// measured when the simulation ends.
+//
+//   cat_feeder_host [--port N] [--speed N] [--drift PPM] [--start SECS]
+//                   [--duration SECS] [--eeprom FILE] [--servo-log]
+//
+// The sketch's server is on 127.0.0.1:8080 unless --port is given. --speed runs
+// the clock that many times faster than real time, --drift makes millis() run
+// fast (or slow) against the true clock by that many parts per million, and
+// --start sets the true time the simulation starts at, in seconds since 1970,
+// the current time by default. The sketch's serial output goes to stdout, the
+// report to stderr when --duration simulated seconds have passed or on SIGINT.
+#include <vector>
+#include <algorithm>
+
+#include <Arduino.h>
+#include <Servo.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include <Time.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+void setup();
+void loop();
+
+namespace Sim {
+    Options options = { 0, 1, 0, 0, 0, NULL, false };
+    Socket sockets[MAX_SOCK_NUM];
+
+    uint64_t realStart; // real us on the monotonic clock when the simulation started
+
+    uint64_t realMicros()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+
+    // simulated us since the start, on the true clock
+    uint64_t trueMicros()
+    {
+        return (realMicros() - realStart) * options.speed;
+    }
+
+    uint64_t trueMillis()
+    {
+        return options.startMs + trueMicros() / 1000;
+    }
+
+    // the board's clock, which runs off the true one by the drift
+    uint64_t boardMicros()
+    {
+        uint64_t t = trueMicros();
+        return t + (int64_t)t * options.driftPpm / 1000000;
+    }
+
+    std::vector<int> watched;
+
+    void watch(int fd)
+    {
+        watched.push_back(fd);
+    }
+
+    uint8_t openSocket(int fd, bool udp, uint16_t port)
+    {
+        for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++) {
+            if (sockets[sock].fd < 0) {
+                sockets[sock].fd = fd;
+                sockets[sock].udp = udp;
+                sockets[sock].port = port;
+                return sock;
+            }
+        }
+        return MAX_SOCK_NUM;
+    }
+
+    // what the client sent after the request is read first, closing with it
+    // unread would reset the connection and could lose the response
+    void closeSocket(uint8_t sock)
+    {
+        int fd = sockets[sock].fd;
+        if (!sockets[sock].udp) {
+            shutdown(fd, SHUT_WR);
+            char buf[256];
+            while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ;
+        }
+        close(fd);
+        sockets[sock].fd = -1;
+    }
+
+    // until a socket has something to read, like an interrupt would wake the board
+    void waitForNetwork(unsigned long ms)
+    {
+        std::vector<pollfd> fds;
+        for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+            if (sockets[sock].fd >= 0) {
+                pollfd p = { sockets[sock].fd, POLLIN, 0 };
+                fds.push_back(p);
+            }
+        }
+        for (size_t i = 0; i < watched.size(); i++) {
+            pollfd p = { watched[i], POLLIN, 0 };
+            fds.push_back(p);
+        }
+        uint64_t us = (uint64_t)ms * 1000 / options.speed;
+        timespec timeout = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+        ppoll(fds.data(), fds.size(), &timeout, NULL);
+    }
+
+    int timeServerFd = -1;
+
+    uint16_t timeServerPort()
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (timeServerFd < 0) {
+            timeServerFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            bind(timeServerFd, (sockaddr *)&addr, sizeof(addr));
+            watch(timeServerFd);
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(timeServerFd, (sockaddr *)&addr, &len);
+        return ntohs(addr.sin_port);
+    }
+
+    void writeNtpTimestamp(uint8_t *buf, uint64_t ms)
+    {
+        uint32_t secs = ms / 1000 + 2208988800UL; // NTP counts from 1900
+        uint32_t fraction = (uint32_t)((ms % 1000) * 4294967296ULL / 1000);
+        for (int i = 0; i < 4; i++) {
+            buf[i] = secs >> (24 - 8*i);
+            buf[4 + i] = fraction >> (24 - 8*i);
+        }
+    }
+
+    // answers each request as a stratum 1 server whose clock is the true one
+    void serviceTimeServer()
+    {
+        if (timeServerFd < 0)
+            return;
+        uint8_t packet[48];
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t n;
+        while ((n = recvfrom(timeServerFd, packet, sizeof(packet), MSG_DONTWAIT, (sockaddr *)&from, &fromLen)) > 0) {
+            if (n < 48 || (packet[0] & 0x07) != 3) // not a client request
+                continue;
+            uint8_t reply[48];
+            memset(reply, 0, sizeof(reply));
+            uint64_t ms = trueMillis();
+            reply[0] = (4 << 3) | 4; // no leap second, version 4, server
+            reply[1] = 1;            // stratum
+            reply[2] = packet[2];    // poll
+            reply[3] = 0xEC;         // precision
+            memcpy(reply + 12, "SIM", 4);
+            writeNtpTimestamp(reply + 16, ms);  // reference
+            memcpy(reply + 24, packet + 40, 8); // originate, the request's transmit
+            writeNtpTimestamp(reply + 32, ms);  // receive
+            writeNtpTimestamp(reply + 40, ms);  // transmit
+            sendto(timeServerFd, reply, sizeof(reply), 0, (sockaddr *)&from, fromLen);
+            fromLen = sizeof(from);
+        }
+    }
+
+    uint8_t eeprom[E2END + 1];
+    int eepromFd = -1;
+
+    void setupEeprom()
+    {
+        memset(eeprom, 0xFF, sizeof(eeprom)); // as erased
+        if (!options.eeprom)
+            return;
+        eepromFd = open(options.eeprom, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (eepromFd < 0) {
+            perror(options.eeprom);
+            exit(1);
+        }
+        if (pread(eepromFd, eeprom, sizeof(eeprom), 0) < (ssize_t)sizeof(eeprom))
+            pwrite(eepromFd, eeprom, sizeof(eeprom), 0);
+    }
+
+    // What the feedings and the clock were like
+    struct Measures {
+        unsigned long loops;
+        unsigned long servoWrites;
+        std::vector<long> feedLateMs;
+        long maxClockErrorMs; // once the clock has been synced
+        unsigned long lastClockCheck;
+    };
+    Measures measures;
+
+    void checkClock()
+    {
+        unsigned long secs = trueMicros() / 1000000;
+        if (secs == measures.lastClockCheck || !clockSet())
+            return;
+        measures.lastClockCheck = secs;
+        long error = labs(clockErrorMs());
+        if (error > measures.maxClockErrorMs)
+            measures.maxClockErrorMs = error;
+    }
+
+    void report()
+    {
+        fflush(stdout);
+        fprintf(stderr, "simulated %.1f s in %.1f s, loop() ran %lu times\n",
+            trueMicros() / 1e6, (realMicros() - realStart) / 1e6, measures.loops);
+
+        std::vector<long> &late = measures.feedLateMs;
+        fprintf(stderr, "feedings %lu", (unsigned long)late.size());
+        if (!late.empty()) {
+            std::sort(late.begin(), late.end());
+            long total = 0;
+            for (size_t i = 0; i < late.size(); i++)
+                total += late[i];
+            fprintf(stderr, ", ms after the feed time: min %ld avg %ld max %ld",
+                late.front(), total / (long)late.size(), late.back());
+        }
+        fprintf(stderr, ", servo writes %lu\n", measures.servoWrites);
+
+        if (clockSet())
+            fprintf(stderr, "clock error ms: now %ld, at most %ld once synced; drift ppm: estimated %ld, simulated %ld\n",
+                clockErrorMs(), measures.maxClockErrorMs, clockDrift(), options.driftPpm);
+        else
+            fprintf(stderr, "the clock was never synced\n");
+    }
+
+    volatile sig_atomic_t stopping = 0;
+
+    void stop(int)
+    {
+        stopping = 1;
+    }
+
+    void usage()
+    {
+        fprintf(stderr, "usage: cat_feeder_host [--port N] [--speed N] [--drift PPM] [--start SECS]\n"
+            "                       [--duration SECS] [--eeprom FILE] [--servo-log]\n");
+        exit(2);
+    }
+
+    void parseOptions(int argc, char **argv)
+    {
+        options.startMs = (uint64_t)time(NULL) * 1000;
+        for (int i = 1; i < argc; i++) {
+            const char *arg = argv[i];
+            if (strcmp(arg, "--servo-log") == 0) {
+                options.servoLog = true;
+                continue;
+            }
+            if (i + 1 >= argc)
+                usage();
+            const char *value = argv[++i];
+            if (strcmp(arg, "--port") == 0)
+                options.port = atoi(value);
+            else if (strcmp(arg, "--speed") == 0)
+                options.speed = strtoul(value, NULL, 10);
+            else if (strcmp(arg, "--drift") == 0)
+                options.driftPpm = atol(value);
+            else if (strcmp(arg, "--start") == 0)
+                options.startMs = strtoull(value, NULL, 10) * 1000;
+            else if (strcmp(arg, "--duration") == 0)
+                options.duration = strtoul(value, NULL, 10);
+            else if (strcmp(arg, "--eeprom") == 0)
+                options.eeprom = value;
+            else
+                usage();
+        }
+        if (options.speed == 0)
+            usage();
+    }
+}
+
+unsigned long millis()
+{
+    return (uint32_t)(Sim::boardMicros() / 1000); // wraps as the board's does
+}
+
+unsigned long micros()
+{
+    return (uint32_t)Sim::boardMicros();
+}
+
+void delay(unsigned long ms)
+{
+    unsigned long start = millis();
+    while (millis() - start < ms)
+        usleep(1000 / Sim::options.speed);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    usleep(us / Sim::options.speed);
+}
+
+void dtIdleSleep(unsigned long ms)
+{
+    Sim::waitForNetwork(ms);
+}
+
+void randomSeed(unsigned int seed)
+{
+    if (seed != 0)
+        srandom(seed);
+}
+
+long random(long howbig)
+{
+    return howbig == 0 ? 0 : ::random() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+    return howsmall >= howbig ? howsmall : random(howbig - howsmall) + howsmall;
+}
+
+uint8_t MCUSR;
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    return Sim::eeprom[(uintptr_t)addr & E2END];
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+    size_t i = (uintptr_t)addr & E2END;
+    Sim::eeprom[i] = value;
+    if (Sim::eepromFd >= 0)
+        pwrite(Sim::eepromFd, &value, 1, i);
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+    if (eeprom_read_byte(addr) != value)
+        eeprom_write_byte(addr, value);
+}
+
+// The watchdog would reset the board, the simulation ends instead; run it
+// again with the same --eeprom to boot from what the sketch saved
+void wdt_enable(uint8_t)
+{
+    fprintf(stderr, "soft reset\n");
+    Sim::report();
+    exit(0);
+}
+
+// A feeding starts when the servo leaves the neutral position
+void Servo::write(int value)
+{
+    value = constrain(value, 0, 180);
+    int neutral = Sim::neutralAngle();
+    if (attached() && angle == neutral && value != neutral)
+        Sim::measures.feedLateMs.push_back(Sim::feedLateMs());
+    angle = value;
+    Sim::measures.servoWrites++;
+    if (Sim::options.servoLog) {
+        uint64_t ms = Sim::trueMillis();
+        fprintf(stderr, "servo %llu.%03llu %d\n",
+            (unsigned long long)(ms / 1000), (unsigned long long)(ms % 1000), value);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Sim::parseOptions(argc, argv);
+    signal(SIGINT, Sim::stop);
+    signal(SIGTERM, Sim::stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int sock = 0; sock < MAX_SOCK_NUM; sock++)
+        Sim::sockets[sock].fd = -1;
+    Sim::setupEeprom();
+    Sim::realStart = Sim::realMicros();
+
+    setup();
+    while (!Sim::stopping
+            && (Sim::options.duration == 0 || Sim::trueMicros() < Sim::options.duration * 1000000ULL)) {
+        loop();
+        Sim::measures.loops++;
+        Sim::checkClock();
+    }
+    Sim::report();
+    return 0;
+}
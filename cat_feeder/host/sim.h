@@ -0,0 +1,51 @@
+// The simulation the host build runs the sketch in: the clock, the network
+// and what is measured, shared by sim.cpp, ethernet.cpp and sketch.cpp
+#ifndef sim_h
+#define sim_h
+
+#include <Ethernet.h>
+#include <stdint.h>
+
+namespace Sim {
+    struct Options {
+        uint16_t port;          // the sketch's server is on this port of 127.0.0.1, 0 for its own port + 8000
+        unsigned long speed;    // simulated seconds per real second
+        long driftPpm;          // how fast millis() runs against the true clock
+        uint64_t startMs;       // the true time when the simulation starts, ms since 1970 UTC
+        unsigned long duration; // simulated seconds to run for, 0 until interrupted
+        const char *eeprom;     // a file to keep the EEPROM in, NULL to start blank every run
+        bool servoLog;          // print every servo write to stderr
+    };
+    extern Options options;
+
+    // ms since 1970 UTC on the true clock, the one the time server answers from
+    uint64_t trueMillis();
+
+    // The W5100's sockets, each a host socket while in use
+    struct Socket {
+        int fd;         // -1 when free
+        bool udp;
+        uint16_t port;  // the sketch's port, for a server's connections
+    };
+    extern Socket sockets[MAX_SOCK_NUM];
+
+    // a free socket for the host socket fd, or MAX_SOCK_NUM if all are in use
+    uint8_t openSocket(int fd, bool udp, uint16_t port);
+    void closeSocket(uint8_t sock);
+
+    // host sockets other than the W5100's that wake the idle sleep, the servers' listening ones
+    void watch(int fd);
+
+    // The time servers the sketch asks are one server on the loopback interface,
+    // it answers when the sketch polls for packets or sleeps
+    uint16_t timeServerPort();
+    void serviceTimeServer();
+
+    // Measured against the sketch's own state, defined in sketch.cpp
+    int neutralAngle();
+    long clockErrorMs();  // the sketch's clock against the true one
+    long feedLateMs();    // how long ago the latest scheduled feed time was, on the true clock
+    bool clockSet();
+}
+
+#endif
@@ -0,0 +1,45 @@
+// The sketch, built for the host, and what the simulation measures against its state
+#include <Arduino.h>
+#include "../cat_feeder.ino"
+
+#include "sim.h"
+
+namespace Sim {
+    const long MS_PER_DAY = SECS_PER_DAY * 1000L;
+
+    int neutralAngle()
+    {
+        return FeedServo::servoNeutral;
+    }
+
+    // the true time in the sketch's time zone
+    uint64_t trueLocalMillis()
+    {
+        return trueMillis() + NTP::timeZone * (long)SECS_PER_HOUR * 1000;
+    }
+
+    long clockErrorMs()
+    {
+        uint16_t ms;
+        time_t t = nowMillis(ms);
+        return (long)((int64_t)t * 1000 + ms - (int64_t)trueLocalMillis());
+    }
+
+    long feedLateMs()
+    {
+        long msToday = trueLocalMillis() % MS_PER_DAY;
+        long late = MS_PER_DAY;
+        for (int i = 0; i < NUM_FEEDS; i++) {
+            long scheduled = (long)((feedTime + i*feedDelta) % SECS_PER_DAY) * 1000;
+            long since = (msToday - scheduled + MS_PER_DAY) % MS_PER_DAY;
+            if (since < late)
+                late = since;
+        }
+        return late;
+    }
+
+    bool clockSet()
+    {
+        return timeStatus() == timeSet;
+    }
+}
@@ -0,0 +1,59 @@
+#include <Ethernet.h>
+#include <Client.h>
+
+// Helpers for the requests the sketch answers itself rather than through the RestServer
+namespace HTTP {
+
+    // Counts what is printed, to send the Content-Length before the body
+    struct CountingPrint : Print {
+        size_t count;
+        CountingPrint() : count(0) {}
+        virtual size_t write(uint8_t) { count++; return 1; }
+    };
+
+    // Collects what is printed into packets, the W5100 sends every client write on its own
+    struct BufferedPrint : Print {
+        Client &client;
+        uint8_t buf[64];
+        uint8_t len;
+        BufferedPrint(Client &c) : client(c), len(0) {}
+        virtual size_t write(uint8_t b) {
+            buf[len++] = b;
+            if (len == sizeof(buf))
+                send();
+            return 1;
+        }
+        void send() {
+            if (len > 0)
+                client.write(buf, len);
+            len = 0;
+        }
+    };
+
+    // Gives back the start of a request that was read to route it, then reads on from the client.
+    // It is a Client itself, so it can be handed to the RestServer in place of the EthernetClient.
+    struct ReplayClient : Client {
+        Client *client;
+        const char *replay; // what is left of the start, NUL terminated
+        virtual int connect(IPAddress ip, uint16_t port) { return client->connect(ip, port); }
+        virtual int connect(const char *host, uint16_t port) { return client->connect(host, port); }
+        virtual size_t write(uint8_t b) { return client->write(b); }
+        virtual size_t write(const uint8_t *buf, size_t size) { return client->write(buf, size); }
+        virtual int available() { return strlen(replay) + client->available(); }
+        virtual int read() { return *replay ? (uint8_t)*replay++ : client->read(); }
+        virtual int read(uint8_t *buf, size_t size) {
+            size_t n = 0;
+            while (n < size && *replay)
+                buf[n++] = *replay++;
+            if (n == size)
+                return n;
+            int more = client->read(buf + n, size - n);
+            return (more > 0) ? n + more : (n > 0 ? (int)n : more);
+        }
+        virtual int peek() { return *replay ? (uint8_t)*replay : client->peek(); }
+        virtual void flush() { client->flush(); }
+        virtual void stop() { replay = ""; client->stop(); }
+        virtual uint8_t connected() { return *replay ? 1 : client->connected(); }
+        virtual operator bool() { return *client; }
+    };
+};
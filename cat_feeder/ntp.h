@@ -7,10 +7,13 @@
 
 namespace NTP {
 
-    // NTP Servers:
-    IPAddress timeServer(132, 163, 4, 101); // time-a.timefreq.bldrdoc.gov
-    // IPAddress timeServer(132, 163, 4, 102); // time-b.timefreq.bldrdoc.gov
-    // IPAddress timeServer(132, 163, 4, 103); // time-c.timefreq.bldrdoc.gov
+    // NTP Servers, all are asked at once and the best answer is used:
+    IPAddress timeServers[] = {
+        IPAddress(132, 163, 4, 101), // time-a.timefreq.bldrdoc.gov
+        IPAddress(132, 163, 4, 102), // time-b.timefreq.bldrdoc.gov
+        IPAddress(132, 163, 4, 103)  // time-c.timefreq.bldrdoc.gov
+    };
+    const int NTP_SERVER_COUNT = sizeof(timeServers) / sizeof(timeServers[0]);
 
     //const int timeZone = 1;     // Central European Time
     //const int timeZone = -5;  // Eastern Standard Time (USA)
@@ -23,9 +26,153 @@ namespace NTP {
     /*-------- NTP code ----------*/
 
     const int NTP_PACKET_SIZE = 48; // NTP time is in the first 48 bytes of message
+    const uint32_t SEVENTY_YEARS = 2208988800UL; // NTP counts seconds from 1900, time_t from 1970
+    const int32_t MAX_DIFF_MS = 0x7fffffffL; // larger differences are saturated to this, about 24 days
+    const int32_t MAX_DIFF_SECS = MAX_DIFF_MS / 1000 - 1;
+
+    // An NTP timestamp to the millisecond
+    struct Timestamp {
+        uint32_t secs; // since 1900 UTC
+        uint16_t ms;
+    };
+
+    // The result of one exchange with a server
+    struct Sample {
+        time_t time;    // local time when the response arrived
+        uint16_t ms;    // milliseconds into that second
+        long offset;    // ms the server is ahead of the local clock, saturated at about 24 days
+        uint32_t delay; // ms round trip, not counting the time the server held the request
+        uint32_t received; // millis() when it arrived
+    };
+
+    // the local clock as an NTP timestamp
+    Timestamp clockTimestamp()
+    {
+        Timestamp ts;
+        ts.secs = nowMillis(ts.ms) - timeZone * SECS_PER_HOUR + SEVENTY_YEARS;
+        return ts;
+    }
+
+    Timestamp readTimestamp(const byte *buf)
+    {
+        Timestamp ts;
+        ts.secs =  (uint32_t)buf[0] << 24;
+        ts.secs |= (uint32_t)buf[1] << 16;
+        ts.secs |= (uint32_t)buf[2] << 8;
+        ts.secs |= (uint32_t)buf[3];
+        // the top 16 bits of the fraction are enough for milliseconds
+        ts.ms = ((uint32_t)((uint16_t)buf[4] << 8 | buf[5]) * 1000) >> 16;
+        return ts;
+    }
+
+    void writeTimestamp(byte *buf, const Timestamp &ts)
+    {
+        // random bits below the millisecond make the timestamp hard to guess
+        uint32_t fraction = ts.ms * 4294967UL + random(4294);
+        for (int i = 0; i < 4; i++) {
+            buf[i] = ts.secs >> (24 - 8*i);
+            buf[4 + i] = fraction >> (24 - 8*i);
+        }
+    }
+
+    // a - b in milliseconds, in 32 bits whatever the size of long
+    int32_t diffMs(const Timestamp &a, const Timestamp &b)
+    {
+        int32_t secs = (int32_t)(a.secs - b.secs);
+        if (secs > MAX_DIFF_SECS)
+            return MAX_DIFF_MS;
+        if (secs < -MAX_DIFF_SECS)
+            return -MAX_DIFF_MS;
+        return secs * (int32_t)1000 + (int32_t)a.ms - (int32_t)b.ms;
+    }
+
+    // Checks that a response answers the request whose transmit timestamp was originate
+    // and computes the sample. With T1 the local time the request was sent, T2 and T3 the
+    // server's receive and transmit timestamps, and T4 the local time the response arrived:
+    //   offset = ((T2 - T1) + (T3 - T4)) / 2
+    //   delay = (T4 - T1) - (T3 - T2)
+    // The time at T4 is then T3 + delay / 2.
+    bool parseNtpPacket(const byte *packet, const byte *originate,
+            const Timestamp &t1, const Timestamp &t4, Sample &s)
+    {
+        if ((packet[0] & 0x07) != 4) // mode: not a server response
+            return false;
+        if ((packet[0] >> 6) == 3) // leap indicator: the server is not synchronized
+            return false;
+        if (packet[1] == 0 || packet[1] > 15) // stratum: kiss-o'-death or unsynchronized
+            return false;
+        if (memcmp(packet + 24, originate, 8) != 0) // not an answer to our request
+            return false;
+
+        Timestamp t2 = readTimestamp(packet + 32);
+        Timestamp t3 = readTimestamp(packet + 40);
+        if (t3.secs == 0)
+            return false;
+
+        int64_t delay = (int64_t)diffMs(t4, t1) - diffMs(t3, t2);
+        s.delay = (delay > 0) ? delay : 0; // the server's clock may be coarser than ours
+        s.offset = diffMs(t2, t1) / 2 + diffMs(t3, t4) / 2;
+
+        uint32_t ms = t3.ms + s.delay / 2;
+        s.time = t3.secs + ms / 1000 - SEVENTY_YEARS + timeZone * SECS_PER_HOUR;
+        s.ms = ms % 1000;
+        return true;
+    }
+
+    // A request in flight to one server
+    struct Request {
+        byte originate[8]; // its transmit timestamp, echoed by the server
+        Timestamp t1;      // local time it was sent
+        bool answered;
+        Sample sample;
+    };
+
+    // The poll interval is 2^pollExponent seconds. A burst of samples a few seconds apart
+    // sets the clock at boot, then the interval doubles while the offsets stay small
+    // and shrinks again when they jump.
+    const uint8_t NTP_MIN_POLL = 6;      // 64 s
+    const uint8_t NTP_MAX_POLL = 15;     // about 9 hours
+    const uint8_t NTP_BURST = 4;         // samples in the boot burst
+    const time_t NTP_BURST_INTERVAL = 2; // seconds between them
+    const long NTP_STEADY_MS = 128;      // offsets within this let the interval grow
+    const uint8_t NTP_STEADY_COUNT = 2;  // after this many in a row
+    const long NTP_JUMP_MS = 4 * NTP_STEADY_MS; // offsets beyond this shrink it by a factor of 4
+
+    uint8_t pollExponent = NTP_MIN_POLL;
+    uint8_t burstLeft = NTP_BURST;
+    uint8_t steadyCount;
+
+    // choose the interval until the next sync from the offset just measured
+    void adaptPoll(long offset)
+    {
+        if (burstLeft > 0 && --burstLeft > 0) {
+            setSyncInterval(NTP_BURST_INTERVAL);
+            return;
+        }
+
+        if (labs(offset) > NTP_JUMP_MS) {
+            pollExponent = (pollExponent >= NTP_MIN_POLL + 2) ? pollExponent - 2 : NTP_MIN_POLL;
+            steadyCount = 0;
+        } else if (labs(offset) > NTP_STEADY_MS) {
+            steadyCount = 0;
+        } else if (++steadyCount >= NTP_STEADY_COUNT) {
+            steadyCount = 0;
+            if (pollExponent < NTP_MAX_POLL)
+                pollExponent++;
+        }
+        setSyncInterval(1UL << pollExponent);
+    }
+
+    Request requests[NTP_SERVER_COUNT];
+    int answers;          // to the pending requests
+    uint32_t firstAnswer; // millis() when the first one arrived
+    Sample lastSample;    // used for the last successful sync
+    uint16_t syncCount;   // successful syncs, so a new one can be noticed
+    uint16_t failCount;   // and failed ones
+    uint32_t syncDuration; // ms from sending the requests to choosing an answer, for the last successful sync
 
     // send an NTP request to the time server at the given address
-    void sendNTPpacket(IPAddress &address)
+    void sendNTPpacket(IPAddress &address, Request &r)
     {
         byte packetBuffer[NTP_PACKET_SIZE]; //buffer to hold incoming & outgoing packets
         // set all bytes in the buffer to 0
@@ -34,13 +181,18 @@ namespace NTP {
         // (see URL above for details on the packets)
         packetBuffer[0] = 0b11100011;   // LI, Version, Mode
         packetBuffer[1] = 0;     // Stratum, or type of clock
-        packetBuffer[2] = 6;     // Polling Interval
+        packetBuffer[2] = pollExponent;  // Polling Interval
         packetBuffer[3] = 0xEC;  // Peer Clock Precision
         // 8 bytes of zero for Root Delay & Root Dispersion
         packetBuffer[12]  = 49;
         packetBuffer[13]  = 0x4E;
         packetBuffer[14]  = 49;
         packetBuffer[15]  = 52;
+        // the transmit timestamp, the server returns it as the originate timestamp
+        r.t1 = clockTimestamp();
+        writeTimestamp(packetBuffer + 40, r.t1);
+        memcpy(r.originate, packetBuffer + 40, 8);
+        r.answered = false;
         // all NTP fields have been given values, now
         // you can send a packet requesting a timestamp:
         ntpUDP.beginPacket(address, 123); //NTP requests are to port 123
@@ -48,27 +200,102 @@ namespace NTP {
         ntpUDP.endPacket();
     }
 
-    time_t getNtpTime()
+    const uint32_t NTP_TIMEOUT_MS = 3000;
+    const uint32_t NTP_COLLECT_MS = 250; // how long the other servers have after the first answer
+    const uint32_t NTP_AGREE_MS = 50;    // allowance for the servers' own errors when comparing them
+    uint32_t requestSent; // millis() when the pending requests were sent
+
+    // Two samples agree if the ranges the offsets can be in, given their delays, overlap.
+    // Halved so that saturated offsets do not overflow.
+    bool samplesAgree(const Sample &a, const Sample &b)
+    {
+        return labs(a.offset / 2 - b.offset / 2) <= (long)((a.delay + b.delay) / 4 + NTP_AGREE_MS / 2);
+    }
+
+    // the answer with the lowest delay among those that agree with a majority of the answers,
+    // or simply with the lowest delay if there is no majority
+    Sample &selectSample()
+    {
+        Sample *best = NULL;
+        Sample *fastest = NULL;
+        for (int i = 0; i < NTP_SERVER_COUNT; i++) {
+            if (!requests[i].answered)
+                continue;
+            Sample &s = requests[i].sample;
+            int agree = 0;
+            for (int j = 0; j < NTP_SERVER_COUNT; j++)
+                if (requests[j].answered && samplesAgree(s, requests[j].sample))
+                    agree++;
+            if (2 * agree > answers && (best == NULL || s.delay < best->delay))
+                best = &s;
+            if (fastest == NULL || s.delay < fastest->delay)
+                fastest = &s;
+        }
+        return best ? *best : *fastest;
+    }
+
+    // sync provider for the Time library, split so that now() never waits on the network
+    bool requestNtpTime()
     {
-        byte packetBuffer[NTP_PACKET_SIZE]; //buffer to hold incoming & outgoing packets
         while (ntpUDP.parsePacket() > 0) ; // discard any previously received packets
-        Serial.println("Transmit NTP Request");
-        sendNTPpacket(timeServer);
-        uint32_t beginWait = millis();
-        while (millis() - beginWait < 3000) {
-            int size = ntpUDP.parsePacket();
-            if (size >= NTP_PACKET_SIZE) {
-                ntpUDP.read(packetBuffer, NTP_PACKET_SIZE);  // read packet into the buffer
-                unsigned long secsSince1900;
-                // convert four bytes starting at location 40 to a long integer
-                secsSince1900 =  (unsigned long)packetBuffer[40] << 24;
-                secsSince1900 |= (unsigned long)packetBuffer[41] << 16;
-                secsSince1900 |= (unsigned long)packetBuffer[42] << 8;
-                secsSince1900 |= (unsigned long)packetBuffer[43];
-                return secsSince1900 - 2208988800UL + timeZone * SECS_PER_HOUR;
+        Serial.println(F("Transmit NTP Requests"));
+        for (int i = 0; i < NTP_SERVER_COUNT; i++)
+            sendNTPpacket(timeServers[i], requests[i]);
+        answers = 0;
+        requestSent = millis();
+        return true;
+    }
+
+    timeSyncResult_t pollNtpTime(time_t &t, uint16_t &ms)
+    {
+        int size;
+        while ((size = ntpUDP.parsePacket()) > 0) {
+            if (size < NTP_PACKET_SIZE)
+                continue;
+            Timestamp t4 = clockTimestamp();
+            byte packetBuffer[NTP_PACKET_SIZE]; //buffer to hold incoming & outgoing packets
+            ntpUDP.read(packetBuffer, NTP_PACKET_SIZE);  // read packet into the buffer
+            // the originate timestamp tells which request it answers, anything
+            // that answers none is ignored, it may be a late or forged reply
+            for (int i = 0; i < NTP_SERVER_COUNT; i++) {
+                Request &r = requests[i];
+                if (!r.answered && parseNtpPacket(packetBuffer, r.originate, r.t1, t4, r.sample)) {
+                    r.sample.received = millis();
+                    r.answered = true;
+                    if (answers++ == 0)
+                        firstAnswer = millis();
+                    break;
+                }
             }
         }
-        return 0; // return 0 if unable to get the time
+
+        bool timedOut = millis() - requestSent >= NTP_TIMEOUT_MS;
+        if (answers == 0) {
+            if (!timedOut)
+                return timeSyncPending;
+            // unable to get the time, try again soon rather than after a long interval
+            setSyncInterval((burstLeft > 0) ? NTP_BURST_INTERVAL : 1UL << NTP_MIN_POLL);
+            failCount++;
+            return timeSyncFailed;
+        }
+        if (answers < NTP_SERVER_COUNT && millis() - firstAnswer < NTP_COLLECT_MS && !timedOut)
+            return timeSyncPending; // give the slower servers a moment
+
+        lastSample = selectSample();
+        syncCount++;
+        syncDuration = millis() - requestSent;
+        Serial.print(F("NTP answers "));
+        Serial.print(answers);
+        Serial.print(F(", offset ms "));
+        Serial.print(lastSample.offset);
+        Serial.print(F(", delay ms "));
+        Serial.println(lastSample.delay);
+        adaptPoll(lastSample.offset);
+        // the sample is the time when it arrived
+        uint32_t sinceMs = lastSample.ms + (millis() - lastSample.received);
+        t = lastSample.time + sinceMs / 1000;
+        ms = sinceMs % 1000;
+        return timeSyncDone;
     }
 
     void p(Print& to, const char *fmt, ... ){
@@ -80,23 +307,24 @@ namespace NTP {
         to.print(tmp);
     }
 
+    void print_time(Print& serial) {
+        tmElements_t te;
+        breakTime(now(), te);
+        p(serial, "Time set: %04d-%02d-%02d %02d:%02d:%02d",
+            1970 + te.Year, te.Month, te.Day, te.Hour, te.Minute, te.Second);
+        serial.println("");
+    }
+
+    // Starts syncing, which carries on in the background each time now() is called
     void setup(Print& serial) {
         // Assumes Ethernet has been set up with a MAC address already
         unsigned int localPort = 64234;  // local port to listen for UDP packets
         ntpUDP.begin(localPort);
 
-        // Wait until time has been set
-        serial.println(F("Waiting until NTP has synced"));
-        while (timeStatus() != timeSet) {
-            setSyncProvider(getNtpTime);
-            delay(1000);
-            serial.print(".");
-        }
-        time_t t_now = now();
-        tmElements_t te;
-        breakTime(t_now, te);
-        p(serial, "Time set: %04d-%02d-%02d %02d:%02d:%02d",
-            1970 + te.Year, te.Month, te.Day, te.Hour, te.Minute, te.Second);
-        serial.println("");
+        // Correct the resonator's drift, which keeps the offsets small as the poll interval grows
+        setClockDiscipline(1UL << NTP_MAX_POLL);
+
+        serial.println(F("Starting NTP sync"));
+        setSyncProvider(requestNtpTime, pollNtpTime);
     }
 };
@@ -0,0 +1,37 @@
+#include <Time.h>
+#include <TimeAlarms.h>
+#include <eeprom_dict.h>
+
+// The clock is saved to EEPROM now and then so that after a power blip or a
+// soft reset the feeder can run on it at once, while NTP syncs in the background.
+namespace SavedTime {
+    // EEPROM cells wear out after about 100,000 writes, saving hourly lasts over 11 years
+    const time_t saveInterval = SECS_PER_HOUR;
+
+    unsigned long savedTime = 0; // 0 until the time is first saved
+    byte savedStatus = timeNotSet; // how good the clock was when it was saved
+
+    void save() {
+        if (timeStatus() == timeNotSet)
+            return;
+        savedTime = now();
+        savedStatus = timeStatus();
+        EEPROMDict.write("time");
+        EEPROMDict.write("time_status");
+    }
+
+    // Restores the saved time, the clock is provisional until NTP has synced it
+    void setup(Print& serial) {
+        EEPROMDict.map("time", &savedTime);
+        EEPROMDict.map("time_status", &savedStatus);
+        EEPROMDict.initialize(); // reads the saved values, or writes the defaults the first time
+
+        if (savedTime != 0) {
+            setProvisionalTime(savedTime);
+            serial.print(F("Provisional time from EEPROM, saved "));
+            serial.println((savedStatus == timeSet) ? F("synced") : F("unsynced"));
+        }
+
+        Alarm.timerRepeat(saveInterval, save);
+    }
+};
@@ -0,0 +1,141 @@
+#include <Print.h>
+
+// Counters and histograms of where the time goes, kept cheap enough to run all
+// the time: recording is a few shifts and adds, the work is done when they are read
+namespace Stats {
+
+    // Bucket i counts the values of less than 2^i units, the last bucket the rest.
+    // The unit is 2^shift of whatever is recorded. Count is uint16_t unless the
+    // histogram records something every loop(), which would fill that in a minute.
+    const uint8_t BUCKETS = 12;
+
+    template <class Count>
+    struct Histogram {
+        uint8_t shift;
+        Count buckets[BUCKETS]; // saturate rather than wrap
+        unsigned long count;
+        unsigned long max;
+
+        void add(unsigned long v) {
+            if (v > max)
+                max = v;
+            count++;
+            uint8_t i = 0;
+            for (unsigned long units = v >> shift; units != 0 && i < BUCKETS - 1; units >>= 1)
+                i++;
+            if (buckets[i] != (Count)~(Count)0)
+                buckets[i]++;
+        }
+
+        void reset() {
+            memset(buckets, 0, sizeof(buckets));
+            count = 0;
+            max = 0;
+        }
+
+        void print(Print &out) {
+            out.print(F("{\"count\":"));
+            out.print(count);
+            out.print(F(",\"max\":"));
+            out.print(max);
+            out.print(F(",\"unit\":"));
+            out.print(1UL << shift);
+            out.print(F(",\"buckets\":["));
+            for (uint8_t i = 0; i < BUCKETS; i++) {
+                if (i > 0)
+                    out.print(',');
+                out.print(buckets[i]);
+            }
+            out.print(F("]}"));
+        }
+    };
+
+    Histogram<unsigned long> loopMicros = { 4, {0}, 0, 0 }; // loop() work before Alarm.delay(0), in 16 us units
+    Histogram<uint16_t> requestMillis = { 0, {0}, 0, 0 };   // from a request's turn to its response being written
+    Histogram<uint16_t> syncMillis = { 0, {0}, 0, 0 };      // NTP syncs, from sending the requests to choosing an answer
+    Histogram<uint16_t> feedLateSecs = { 0, {0}, 0, 0 };    // how late the feed alarms were serviced
+    unsigned long idleMillis;        // in Alarm.delay(0), waiting for the next millis() tick or running alarms
+    unsigned int idleMicros;         // the part of a millisecond not yet in idleMillis
+    unsigned long requestTimeouts;
+    unsigned long syncFailures;
+    unsigned long since;             // millis() when the stats were reset
+
+#ifdef __AVR__
+    // The free SRAM between the heap and the stack is painted at boot. How much of the
+    // paint is left shows how close the stack has come to the heap since.
+    extern "C" char __heap_start;
+    extern "C" char *__brkval;
+    const uint8_t PAINT = 0xc5;
+
+    char *heapEnd() { return __brkval ? __brkval : &__heap_start; }
+
+    void paintStack() {
+        char here;
+        for (char *p = heapEnd(); p < &here - 32; p++) // leave what this call is using
+            *p = PAINT;
+    }
+
+    unsigned int freeNow() {
+        char here;
+        return &here - heapEnd();
+    }
+
+    unsigned int freeLowWater() {
+        char here;
+        char *p = heapEnd();
+        while (p < &here && *p == PAINT)
+            p++;
+        return p - heapEnd();
+    }
+#else
+    void paintStack() {}
+    unsigned int freeNow() { return 0; }
+    unsigned int freeLowWater() { return 0; }
+#endif
+
+    // subtracting is cheaper than a 32 bit division on the AVR, and us is rarely much over 1000
+    void addIdle(unsigned long us) {
+        us += idleMicros;
+        while (us >= 1000) {
+            idleMillis++;
+            us -= 1000;
+        }
+        idleMicros = us;
+    }
+
+    void reset() {
+        loopMicros.reset();
+        idleMillis = 0;
+        idleMicros = 0;
+        requestMillis.reset();
+        syncMillis.reset();
+        feedLateSecs.reset();
+        requestTimeouts = 0;
+        syncFailures = 0;
+        since = millis();
+    }
+
+    void print(Print &out) {
+        out.print(F("{\"secs\":"));
+        out.print((millis() - since) / 1000);
+        out.print(F(",\"loop_us\":"));
+        loopMicros.print(out);
+        out.print(F(",\"idle_ms\":"));
+        out.print(idleMillis);
+        out.print(F(",\"request_ms\":"));
+        requestMillis.print(out);
+        out.print(F(",\"request_timeouts\":"));
+        out.print(requestTimeouts);
+        out.print(F(",\"sync_ms\":"));
+        syncMillis.print(out);
+        out.print(F(",\"sync_failures\":"));
+        out.print(syncFailures);
+        out.print(F(",\"feed_late_secs\":"));
+        feedLateSecs.print(out);
+        out.print(F(",\"sram_free\":"));
+        out.print(freeNow());
+        out.print(F(",\"sram_low_water\":"));
+        out.print(freeLowWater());
+        out.print('}');
+    }
+};
@@ -11,12 +11,23 @@
 #include <avr/pgmspace.h>
 #else
 // for compatiblity with Arduino Due and Teensy 3.0 and maybe others?
+// their cores may already provide some of these
+#ifndef PROGMEM
 #define PROGMEM
+#endif
+#ifndef PGM_P
 #define PGM_P  const char *
+#endif
+#ifndef pgm_read_byte
 #define pgm_read_byte(addr) (*(const unsigned char *)(addr))
-#define pgm_read_word(addr) (*(const unsigned char **)(addr))
+#endif
+#ifndef pgm_read_word
+#define pgm_read_word(addr) (*(const char * const *)(addr))  // only used to read the string pointers
+#endif
+#ifndef strcpy_P
 #define strcpy_P(dest, src) strcpy((dest), (src))
 #endif
+#endif
 #include <string.h> // for strcpy_P or strcpy
 #include "Time.h"
  
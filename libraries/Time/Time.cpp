@@ -34,12 +34,40 @@
 
 #include "Time.h"
 
-static tmElements_t tm;          // a cache of time elements
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#else  // some cores provide these without avr/pgmspace.h
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef pgm_read_word
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#endif
+#endif
+
+static tmElements_t tm = {0, 0, 0, 5, 1, 1, 0};  // a cache of time elements, initially for time 0 (a Thursday)
 static time_t cacheTime;   // the time the cache was updated
 static uint32_t syncInterval = 300;  // time sync will be attempted after this many seconds
+static uint32_t baseSyncInterval = 300;  // as given to setSyncInterval, a disciplined clock may sync less often
 
 void refreshCache(time_t t) {
   if (t != cacheTime) {
+    if (t > cacheTime && t - cacheTime < (time_t)SECS_PER_HOUR) {
+      // a small step forward only changes the time of day, unless it passes midnight
+      uint16_t seconds = tm.Minute * 60 + tm.Second + (uint16_t)(t - cacheTime);
+      uint8_t hours = tm.Hour;
+      if (seconds >= SECS_PER_HOUR) {
+        seconds -= SECS_PER_HOUR;
+        hours++;
+      }
+      if (hours < 24) {
+        tm.Hour = hours;
+        tm.Minute = seconds / 60;
+        tm.Second = seconds % 60;
+        cacheTime = t;
+        return;
+      }
+    }
     breakTime(t, tm); 
     cacheTime = t; 
   }
@@ -145,59 +173,54 @@ int year(time_t t) { // the year for the given time
 // leap year calulator expects year argument as years offset from 1970
 #define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
 
-static  const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API starts months from 1, this array starts from 0
+static const uint16_t monthDaysBefore[] PROGMEM = {0,31,59,90,120,151,181,212,243,273,304,334}; // days in the year before each month, not counting a leap day
  
+// breakTime counts days from 1 Mar 1968, so each 4 year cycle ends with its leap day
+#define DAYS_TO_1970       671U    // days from 1 Mar 1968 to 1 Jan 1970
+#define DAYS_TO_MARCH_2100 48212U  // days from 1 Mar 1968 to 1 Mar 2100, which follows the first non leap 28 Feb
+#define DAYS_PER_4_YEARS   1461U
+
 void breakTime(time_t timeInput, tmElements_t &tm){
 // break the given time_t into time components
 // this is a more compact version of the C library localtime function
 // note that year is offset from 1970 !!!
+// only the days are found with a 32 bit division, the rest fits in 16 bits
 
-  uint8_t year;
-  uint8_t month, monthLength;
   uint32_t time;
-  unsigned long days;
+  uint16_t days, seconds, minutes;
+  uint8_t hours, year, month;
 
   time = (uint32_t)timeInput;
-  tm.Second = time % 60;
-  time /= 60; // now it is minutes
-  tm.Minute = time % 60;
-  time /= 60; // now it is hours
-  tm.Hour = time % 24;
-  time /= 24; // now it is days
-  tm.Wday = ((time + 4) % 7) + 1;  // Sunday is day 1 
-  
-  year = 0;  
-  days = 0;
-  while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time) {
-    year++;
-  }
-  tm.Year = year; // year is offset from 1970 
-  
-  days -= LEAP_YEAR(year) ? 366 : 365;
-  time  -= days; // now it is days in this year, starting at 0
-  
-  days=0;
-  month=0;
-  monthLength=0;
-  for (month=0; month<12; month++) {
-    if (month==1) { // february
-      if (LEAP_YEAR(year)) {
-        monthLength=29;
-      } else {
-        monthLength=28;
-      }
-    } else {
-      monthLength = monthDays[month];
-    }
-    
-    if (time >= monthLength) {
-      time -= monthLength;
-    } else {
-        break;
-    }
+  days = time / SECS_PER_DAY;
+  time -= days * SECS_PER_DAY; // now it is seconds today
+  hours = (uint16_t)(time >> 4) / (uint16_t)(SECS_PER_HOUR >> 4);  // both fit in 16 bits
+  seconds = time - hours * SECS_PER_HOUR;
+  minutes = seconds / 60;
+  tm.Hour = hours;
+  tm.Minute = minutes;
+  tm.Second = seconds - minutes * 60;
+  tm.Wday = ((days + 4) % 7) + 1;  // Sunday is day 1 
+
+  days += DAYS_TO_1970;
+  if (days >= DAYS_TO_MARCH_2100)
+    days++;  // 2100 is not a leap year, skip the 29 Feb that the cycles below assume
+  year = days / DAYS_PER_4_YEARS * 4;
+  days %= DAYS_PER_4_YEARS;
+  uint8_t yearOfCycle = days / 365;
+  if (yearOfCycle == 4)
+    yearOfCycle = 3;  // the leap day at the end of the cycle
+  year += yearOfCycle;
+  days -= yearOfCycle * 365; // now it is days since 1 March, starting at 0
+
+  month = (5 * days + 2) / 153; // March is 0, the 153 days from March to July repeat from August
+  tm.Day = days - (153 * month + 2) / 5 + 1;  // day of month
+  if (month < 10) {
+    tm.Month = month + 3;  // jan is month 1  
+  } else {
+    tm.Month = month - 9;
+    year++;  // January and February belong to the next year
   }
-  tm.Month = month + 1;  // jan is month 1  
-  tm.Day = time + 1;     // day of month
+  tm.Year = year - 2; // year is offset from 1970 
 }
 
 time_t makeTime(tmElements_t &tm){   
@@ -205,26 +228,21 @@ time_t makeTime(tmElements_t &tm){
 // note year argument is offset from 1970 (see macros in time.h to convert to other formats)
 // previous version used full four digit year (or digits since 2000),i.e. 2009 was 2009 or 9
   
-  int i;
-  uint32_t seconds;
-
-  // seconds from 1970 till 1 jan 00:00:00 of the given year
-  seconds= tm.Year*(SECS_PER_DAY * 365);
-  for (i = 0; i < tm.Year; i++) {
-    if (LEAP_YEAR(i)) {
-      seconds +=  SECS_PER_DAY;   // add extra days for leap years
-    }
-  }
-  
+  uint16_t days;
+  uint16_t lastYear = tmYearToCalendar(tm.Year) - 1;
+
+  // days from 1970 till 1 jan of the given year, with a leap day for each leap year from 1970 to last year
+  days = tm.Year * 365U + lastYear / 4 - lastYear / 100 + lastYear / 400 - (1969 / 4 - 1969 / 100 + 1969 / 400);
+
   // add days for this year, months start from 1
-  for (i = 1; i < tm.Month; i++) {
-    if ( (i == 2) && LEAP_YEAR(tm.Year)) { 
-      seconds += SECS_PER_DAY * 29;
-    } else {
-      seconds += SECS_PER_DAY * monthDays[i-1];  //monthDay array starts from 0
-    }
+  if (tm.Month >= 2 && tm.Month <= 12) {
+    days += pgm_read_word(&monthDaysBefore[tm.Month - 1]);
+    if (tm.Month > 2 && LEAP_YEAR(tm.Year))
+      days++;
   }
-  seconds+= (tm.Day-1) * SECS_PER_DAY;
+  days += tm.Day - 1;
+
+  uint32_t seconds = days * SECS_PER_DAY;
   seconds+= tm.Hour * SECS_PER_HOUR;
   seconds+= tm.Minute * SECS_PER_MIN;
   seconds+= tm.Second;
@@ -239,35 +257,142 @@ static uint32_t nextSyncTime = 0;
 static timeStatus_t Status = timeNotSet;
 
 getExternalTime getTimePtr;  // pointer to external sync function
+static requestExternalTime requestTimePtr;  // or the two halves of a sync that does not block
+static pollExternalTime pollTimePtr;
+static bool syncPending = false;  // a request has been made and is being polled
+static bool inProvider = false;   // a provider is running, it may call now() but that does not sync again
+static bool providerInterval = false;  // the provider chose the sync interval, the discipline leaves it
 //setExternalTime setTimePtr; // not used in this version
 
 #ifdef TIME_DRIFT_INFO   // define this to get drift data
 time_t sysUnsyncedTime = 0; // the time sysTime unadjusted by sync  
 #endif
 
+// clock discipline, the drift of millis() is measured between syncs and corrected in now()
+#define DISCIPLINE_MIN_MS    60000UL  // syncs closer together than this do not measure the drift
+#define DISCIPLINE_TOLERANCE 1000L    // ms, the interval doubles while the estimate predicts each sync this well
+#define DISCIPLINE_MAX_PPM   100000L  // larger drifts are taken to be a bad sync
+
+static uint32_t maxSyncInterval = 0;  // 0 if the clock is not disciplined
+static long driftPpm = 0;             // positive if millis() runs fast
+static uint32_t driftStep = 0;        // ms of millis() for each ms of correction, 0 for none
+static uint32_t driftMillis;          // millis() up to which the correction has been applied
+static uint32_t lastSyncTime = 0;     // the last sync, 0 if none since the discipline started
+static uint32_t lastSyncMillis;       // millis() when the second lastSyncTime began
+static void syncTime(time_t t, uint16_t ms);
+
 
 time_t now() {
-  while (millis() - prevMillis >= 1000){      
-    sysTime++;
-    prevMillis += 1000;	
+  if (driftStep != 0 && millis() - driftMillis >= driftStep) {  // at most one division per correction
+    uint32_t corrections = (millis() - driftMillis) / driftStep;
+    if (driftPpm > 0) {
+      if (corrections > millis() - prevMillis)
+        corrections = millis() - prevMillis;  // the rest is applied once the next second has started
+      prevMillis += corrections;  // hold the clock back
+    } else {
+      prevMillis -= corrections;  // move it on
+    }
+    driftMillis += corrections * driftStep;
+  }
+  uint32_t elapsed = millis() - prevMillis;
+  if (elapsed >= 1000) {
+    uint32_t seconds = elapsed / 1000;  // however long since the last call
+    sysTime += seconds;
+    prevMillis += seconds * 1000;	
 #ifdef TIME_DRIFT_INFO
-    sysUnsyncedTime++; // this can be compared to the synced time to measure long term drift     
+    sysUnsyncedTime += seconds; // this can be compared to the synced time to measure long term drift     
 #endif
   }
-  if (nextSyncTime <= sysTime) {
+  if (inProvider) {
+    // the provider is asking for the local time
+  } else if (syncPending) {
+    time_t t;
+    uint16_t ms;
+    inProvider = true;
+    providerInterval = false;
+    timeSyncResult_t result = pollTimePtr(t, ms);
+    inProvider = false;
+    if (result != timeSyncPending) {
+      syncPending = false;
+      if (result == timeSyncDone) {
+        syncTime(t, ms);
+      } else {
+        nextSyncTime = sysTime + syncInterval;
+        if (Status == timeSet) Status = timeNeedsSync;
+      }
+    }
+  } else if (nextSyncTime <= sysTime) {
     if (getTimePtr != 0) {
+      inProvider = true;
+      providerInterval = false;
       time_t t = getTimePtr();
+      inProvider = false;
       if (t != 0) {
-        setTime(t);
+        syncTime(t, 0);
       } else {
         nextSyncTime = sysTime + syncInterval;
-        Status = (Status == timeNotSet) ?  timeNotSet : timeNeedsSync;
+        if (Status == timeSet) Status = timeNeedsSync;
+      }
+    } else if (requestTimePtr != 0) {
+      inProvider = true;
+      bool requested = requestTimePtr();
+      inProvider = false;
+      if (requested) {
+        syncPending = true;  // the clock keeps running from millis() until the poll completes
+      } else {
+        nextSyncTime = sysTime + syncInterval;
+        if (Status == timeSet) Status = timeNeedsSync;
       }
     }
   }  
   return (time_t)sysTime;
 }
 
+// compare the time from the provider with millis() since the last sync to estimate the drift
+static void discipline(uint32_t t, uint32_t syncMillis) {
+  if (lastSyncTime != 0 && t > lastSyncTime) {
+    uint32_t secs = t - lastSyncTime;  // both syncs are at the start of a second
+    if (secs >= DISCIPLINE_MIN_MS / 1000 && secs < 0x7fffffffUL / 1000) {
+      long errorMs = (int32_t)(syncMillis - lastSyncMillis - secs * 1000);  // how far millis() ran ahead, negative if behind
+      // errorMs * 1000000 / (secs * 1000) in 32 bits, the remainder times 1000 fits as secs * 1000 does
+      long measured = errorMs / (long)secs * 1000 + errorMs % (long)secs * 1000 / (long)secs;
+      if (labs(measured) < DISCIPLINE_MAX_PPM) {
+        // the old estimate predicted this sync within the tolerance if it was off by no more than this many ppm
+        long tolerancePpm = DISCIPLINE_TOLERANCE * 1000 / (long)secs;
+        if (labs(measured - driftPpm) <= tolerancePpm) {
+          driftPpm = (driftPpm + measured) / 2;
+          if (!providerInterval)
+            syncInterval = (syncInterval * 2 < maxSyncInterval) ? syncInterval * 2 : maxSyncInterval;
+        } else {
+          driftPpm = measured;
+          if (!providerInterval)
+            syncInterval = baseSyncInterval;
+        }
+        driftStep = (driftPpm != 0) ? 1000000UL / labs(driftPpm) : 0;
+        driftMillis = millis();
+      }
+    }
+  }
+  lastSyncTime = t;
+  lastSyncMillis = syncMillis;
+}
+
+// set the time from the provider, whose second t began ms ago
+static void syncTime(time_t t, uint16_t ms) {
+  uint32_t syncMillis = millis() - ms;
+  if (maxSyncInterval != 0)
+    discipline((uint32_t)t, syncMillis);
+  setTime(t);
+  prevMillis = syncMillis;
+}
+
+time_t nowMillis(uint16_t &ms) {
+  time_t t = now();
+  uint32_t elapsed = millis() - prevMillis;
+  ms = (elapsed < 1000) ? elapsed : 999;  // millis() may have moved on to the next second since now() returned
+  return t;
+}
+
 void setTime(time_t t) { 
 #ifdef TIME_DRIFT_INFO
  if(sysUnsyncedTime == 0) 
@@ -283,6 +408,7 @@ void setTime(time_t t) {
 void setTime(int hr,int min,int sec,int dy, int mnth, int yr){
  // year can be given as full four digit year or two digts (2010 or 10 for 2010);  
  //it is converted to years since 1970
+  tmElements_t tm;  // not the cache, which must keep matching cacheTime
   if( yr > 99)
       yr = yr - 1970;
   else
@@ -296,6 +422,12 @@ void setTime(int hr,int min,int sec,int dy, int mnth, int yr){
   setTime(makeTime(tm));
 }
 
+void setProvisionalTime(time_t t) {
+  setTime(t);
+  Status = timeProvisional;  // until a sync succeeds, a failed one leaves it provisional
+  nextSyncTime = sysTime;    // sync as soon as there is a provider
+}
+
 void adjustTime(long adjustment) {
   sysTime += adjustment;
 }
@@ -308,11 +440,39 @@ timeStatus_t timeStatus() {
 
 void setSyncProvider( getExternalTime getTimeFunction){
   getTimePtr = getTimeFunction;  
+  requestTimePtr = 0;
+  pollTimePtr = 0;
+  syncPending = false;
   nextSyncTime = sysTime;
   now(); // this will sync the clock
 }
 
+void setSyncProvider( requestExternalTime requestFunction, pollExternalTime pollFunction){
+  if (requestFunction != requestTimePtr || pollFunction != pollTimePtr)
+    syncPending = false;  // a sync already pending with this provider carries on
+  getTimePtr = 0;
+  requestTimePtr = requestFunction;
+  pollTimePtr = pollFunction;
+  nextSyncTime = sysTime;
+  now(); // this will start a sync, which later calls to now() complete
+}
+
 void setSyncInterval(time_t interval){ // set the number of seconds between re-sync
   syncInterval = (uint32_t)interval;
+  baseSyncInterval = syncInterval;
+  if (inProvider)
+    providerInterval = true;
   nextSyncTime = sysTime + syncInterval;
 }
+
+void setClockDiscipline(time_t maxInterval){
+  maxSyncInterval = (uint32_t)maxInterval;
+  driftPpm = 0;
+  driftStep = 0;
+  lastSyncTime = 0;
+  syncInterval = baseSyncInterval;
+}
+
+long clockDrift(){
+  return driftPpm;
+}
@@ -31,7 +31,7 @@ typedef unsigned long time_t;
 // but at least this hack lets us define C++ functions as intended.  Hopefully
 // nothing too terrible will result from overriding the C library header?!
 extern "C++" {
-typedef enum {timeNotSet, timeNeedsSync, timeSet
+typedef enum {timeNotSet, timeNeedsSync, timeSet, timeProvisional
 }  timeStatus_t ;
 
 typedef enum {
@@ -59,6 +59,12 @@ typedef struct  {
 #define  y2kYearToTm(Y)      ((Y) + 30)   
 
 typedef time_t(*getExternalTime)();
+
+// a sync provider that does not block: the request starts a sync, which is then polled until it completes
+typedef enum {timeSyncPending, timeSyncDone, timeSyncFailed
+}  timeSyncResult_t ;
+typedef bool (*requestExternalTime)();  // returns false if the request could not be sent
+typedef timeSyncResult_t (*pollExternalTime)(time_t &t, uint16_t &ms);  // on timeSyncDone, t and ms into that second are set
 //typedef void  (*setExternalTime)(const time_t); // not used in this version
 
 
@@ -118,8 +124,10 @@ int     year();            // the full four digit year: (2009, 2010 etc)
 int     year(time_t t);    // the year for the given time
 
 time_t now();              // return the current time as seconds since Jan 1 1970 
+time_t nowMillis(uint16_t &ms); // as now(), ms is set to the milliseconds elapsed in the current second
 void    setTime(time_t t);
 void    setTime(int hr,int min,int sec,int day, int month, int yr);
+void    setProvisionalTime(time_t t); // set the time from a source that may be stale, until the next sync
 void    adjustTime(long adjustment);
 
 /* date strings */ 
@@ -132,7 +140,10 @@ char* dayShortStr(uint8_t day);
 /* time sync functions	*/
 timeStatus_t timeStatus(); // indicates if time has been set and recently synchronized
 void    setSyncProvider( getExternalTime getTimeFunction); // identify the external time provider
+void    setSyncProvider( requestExternalTime requestFunction, pollExternalTime pollFunction); // as above, without blocking
 void    setSyncInterval(time_t interval); // set the number of seconds between re-sync
+void    setClockDiscipline(time_t maxInterval); // correct the drift measured between syncs and sync up to maxInterval apart, 0 to stop
+long    clockDrift();      // the estimated drift in parts per million, positive if the clock runs fast
 
 /* low level functions to convert to and from system time                     */
 void breakTime(time_t time, tmElements_t &tm);  // break time_t into elements
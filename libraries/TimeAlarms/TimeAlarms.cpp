@@ -31,39 +31,120 @@ extern "C" {
 #include "TimeAlarms.h"
 #include "Time.h"
 
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#include <avr/interrupt.h>
+#endif
+
 #define IS_ONESHOT  true   // constants used in arguments to create method
 #define IS_REPEAT   false 
 
+// the state shared with the timer interrupt is only changed with interrupts disabled
+#if defined(dtUSE_TIMER_INTERRUPT) && defined(__AVR__)
+static inline uint8_t dtLock(bool lock) { uint8_t sreg = SREG; if(lock) cli(); return sreg; }
+static inline void dtUnlock(uint8_t sreg) { SREG = sreg; }
+#else
+static inline uint8_t dtLock(bool) { return 0; }
+static inline void dtUnlock(uint8_t) {}
+#endif
+
+// true if time a comes before b, correct across a wrap of the counter as long as they are less than 2^31 apart
+#define dtBefore(_a_, _b_)  ((int32_t)((uint32_t)(_a_) - (uint32_t)(_b_)) < 0)
+
 
 //**************************************************************
 //* Alarm Class Constructor
 
 AlarmClass::AlarmClass()
 {
-  Mode.isEnabled = Mode.isOneShot = 0;
+  Mode.isEnabled = Mode.isOneShot = Mode.hasContext = 0;
   Mode.alarmType = dtNotAllocated;
   value = nextTrigger = 0;
   onTickHandler = NULL;  // prevent a callback until this pointer is explicitly set 
+  context = NULL;
+  queuePos = 0;
+#ifdef dtALARM_STATS
+  memset(&stats, 0, sizeof(stats));
+#endif
 }
 
 //**************************************************************
 //* Private Methods
 
  
+time_t AlarmClass::getValue()
+{
+  return Mode.alarmType == dtExplicitAlarm ? nextTrigger : (time_t)value;
+}
+
+bool AlarmClass::setValue(time_t value)
+{
+  if( Mode.alarmType == dtExplicitAlarm )
+  {
+    nextTrigger = value;  // the value is the trigger time
+    this->value = 0;
+  }
+  else if( (uint32_t)value <= dtMAX_VALUE )
+    this->value = value;
+  else
+    return false;
+  return true;
+}
+ 
+#ifdef dtALARM_STATS
+void AlarmClass::recordTrigger()
+{
+  unsigned long lateness;
+  unsigned long period;  // of a repeating alarm in the same units as lateness, 0 if it does not repeat
+  if( Mode.alarmType == dtMillisTimer )
+  {
+    lateness = millis() - nextTrigger;
+    period = value;
+  }
+  else
+  {
+    lateness = now() - nextTrigger;
+    if( Mode.alarmType == dtDailyAlarm )
+      period = SECS_PER_DAY;
+    else if( Mode.alarmType == dtWeeklyAlarm )
+      period = SECS_PER_WEEK;
+    else if( Mode.alarmType == dtTimer )
+      period = value;
+    else
+      period = 0;
+  }
+  if( (long)lateness < 0 )
+    lateness = 0;  // the clock was set back after the alarm became due
+  if( period != 0 && ! Mode.isOneShot )
+    stats.misses += lateness / period;
+  if( Mode.alarmType != dtMillisTimer )
+    lateness *= 1000;
+  stats.count++;
+  stats.lastLateness = lateness;
+  if( lateness > stats.maxLateness )
+    stats.maxLateness = lateness;
+}
+#endif
+
 void AlarmClass::updateNextTrigger()
 {  
-  if( (value != 0) && Mode.isEnabled )
+  if( (getValue() != 0) && Mode.isEnabled )
   {
+    if( Mode.alarmType == dtMillisTimer)
+    {
+      nextTrigger = millis() + value;  // in milliseconds, this may wrap around which dtBefore allows for
+      return;                          // this does not call now() so it is safe in the timer interrupt
+    }
     time_t time = now();
     if( dtIsAlarm(Mode.alarmType) && nextTrigger <= time )   // update alarm if next trigger is not yet in the future
     {      
       if(Mode.alarmType == dtExplicitAlarm ) // is the value a specific date and time in the future
       {
-        nextTrigger = value;  // yes, trigger on this value   
+        // yes, nextTrigger already holds the value
       }
       else if(Mode.alarmType == dtDailyAlarm)  //if this is a daily alarm
       {
-        if( value + previousMidnight(now()) <= time)
+        if( (time_t)(value + previousMidnight(now())) <= time)
         {
           nextTrigger = value + nextMidnight(time); // if time has passed then set for tomorrow
         }
@@ -74,7 +155,7 @@ void AlarmClass::updateNextTrigger()
       }
       else if(Mode.alarmType == dtWeeklyAlarm)  // if this is a weekly alarm
       {
-        if( (value + previousSunday(now())) <= time)
+        if( (time_t)(value + previousSunday(now())) <= time)
         {
           nextTrigger = value + nextSunday(time); // if day has passed then set for the next week.
         }
@@ -100,14 +181,283 @@ void AlarmClass::updateNextTrigger()
   }
 }
 
+//**************************************************************
+//* Alarm Queue Methods
+
+AlarmQueue::AlarmQueue(AlarmClass *alarms, AlarmID_t *ids, int8_t step) : alarms(alarms), ids(ids), step(step)
+{
+  size = 0;
+}
+
+AlarmID_t& AlarmQueue::at(uint8_t pos)
+{
+  return step > 0 ? ids[pos] : *(ids - pos);
+}
+
+bool AlarmQueue::before(uint8_t i, uint8_t j)
+{
+  return dtBefore(alarms[at(i)].nextTrigger, alarms[at(j)].nextTrigger);
+}
+
+void AlarmQueue::swap(uint8_t i, uint8_t j)
+{
+  AlarmID_t tmp = at(i);
+  at(i) = at(j);
+  at(j) = tmp;
+  alarms[at(i)].queuePos = i;
+  alarms[at(j)].queuePos = j;
+}
+
+void AlarmQueue::siftUp(uint8_t pos)
+{
+  while( pos > 0 )
+  {
+    uint8_t parent = (pos - 1) / 2;
+    if( ! before(pos, parent) )
+      break;
+    swap(pos, parent);
+    pos = parent;
+  }
+}
+
+void AlarmQueue::siftDown(uint8_t pos)
+{
+  for(;;)
+  {
+    uint8_t child = 2 * pos + 1;
+    if( child >= size )
+      break;
+    if( child + 1 < size && before(child + 1, child) )
+      child++;  // pick the earlier of the two children
+    if( ! before(child, pos) )
+      break;
+    swap(pos, child);
+    pos = child;
+  }
+}
+
+// there is always room, the queues sharing the array never hold more ids than there are alarms
+void AlarmQueue::insert(AlarmID_t ID)
+{
+  at(size) = ID;
+  alarms[ID].queuePos = size;
+  siftUp(size++);
+}
+
+// queuePos may be left over from another queue or an earlier stay in this one, so check it points back at the id
+void AlarmQueue::remove(AlarmID_t ID)
+{
+  uint8_t pos = alarms[ID].queuePos;
+  if( pos >= size || at(pos) != ID )
+    return;
+  at(pos) = at(--size);  // move the last entry into the hole and restore the heap order around it
+  if( pos < size )
+  {
+    alarms[at(pos)].queuePos = pos;
+    siftUp(pos);
+    siftDown(pos);
+  }
+}
+
+AlarmID_t AlarmQueue::peek()
+{
+  return size ? at(0) : dtINVALID_ALARM_ID;
+}
+
+#ifdef dtUSE_TIMER_WHEEL
+//**************************************************************
+//* Timer Wheel Methods
+
+TimerWheel::TimerWheel(AlarmClass *alarms, AlarmID_t *links, uint8_t capacity) : alarms(alarms), capacity(capacity)
+{
+  tick = 0;
+  size = 0;
+  next = links;
+  prev = links + capacity;
+  list = links + 2 * capacity;
+  memset(head, dtINVALID_ALARM_ID, sizeof(head));
+  memset(list, dtWHEEL_NONE, capacity);
+}
+
+void TimerWheel::link(AlarmID_t ID, uint8_t l)
+{
+  list[ID] = l;
+  prev[ID] = dtINVALID_ALARM_ID;
+  next[ID] = head[l];
+  if( head[l] != dtINVALID_ALARM_ID )
+    prev[head[l]] = ID;
+  head[l] = ID;
+}
+
+void TimerWheel::unlink(AlarmID_t ID)
+{
+  if( prev[ID] != dtINVALID_ALARM_ID )
+    next[prev[ID]] = next[ID];
+  else
+    head[list[ID]] = next[ID];
+  if( next[ID] != dtINVALID_ALARM_ID )
+    prev[next[ID]] = prev[ID];
+  list[ID] = dtWHEEL_NONE;
+}
+
+void TimerWheel::place(AlarmID_t ID)
+{
+  uint32_t due = alarms[ID].nextTrigger;
+  int32_t ahead = (int32_t)(due - tick);
+  if( ahead < 0 )
+  {
+    link(ID, dtWHEEL_DUE);
+    return;
+  }
+  if( (uint32_t)ahead >= dtWHEEL_SPAN )
+    due = tick + dtWHEEL_SPAN - 1;  // too far out, park it in the last slot and place it again when that comes round
+  uint8_t level = 0;
+  while( level < dtWHEEL_LEVELS - 1 && (uint32_t)ahead >= (1UL << (dtWHEEL_BITS * (level + 1))) )
+    level++;
+  uint8_t slot = (due >> (dtWHEEL_BITS * level)) & (dtWHEEL_SLOTS - 1);
+  link(ID, level * dtWHEEL_SLOTS + slot);
+}
+
+void TimerWheel::cascade(uint8_t level, uint8_t slot)
+{
+  uint8_t l = level * dtWHEEL_SLOTS + slot;
+  AlarmID_t id = head[l];
+  head[l] = dtINVALID_ALARM_ID;
+  while( id != dtINVALID_ALARM_ID )
+  {
+    AlarmID_t nextId = next[id];
+    place(id);
+    id = nextId;
+  }
+}
+
+void TimerWheel::rebase(uint32_t time)
+{
+  tick = time + 1;
+  memset(head, dtINVALID_ALARM_ID, sizeof(head));
+  for(uint8_t id = 0; id < capacity; id++)
+  {
+    if( list[id] != dtWHEEL_NONE )
+      place(id);
+  }
+}
+
+void TimerWheel::insert(AlarmID_t ID)
+{
+  place(ID);
+  size++;
+}
+
+void TimerWheel::remove(AlarmID_t ID)
+{
+  if( list[ID] != dtWHEEL_NONE )
+  {
+    unlink(ID);
+    size--;
+  }
+}
+
+void TimerWheel::advance(time_t time)
+{
+  uint32_t t = time;
+  if( size == 0 )
+  {
+    tick = t + 1;  // nothing to expire, just keep up with the clock
+    return;
+  }
+  int32_t behind = (int32_t)(t - tick);
+  if( behind < -1 || behind >= (int32_t)dtWHEEL_SPAN )
+  {
+    rebase(t);  // the clock was set back, or jumped further than walking the slots is worth
+    return;
+  }
+  while( (int32_t)(t - tick) >= 0 )
+  {
+    uint8_t slot = tick & (dtWHEEL_SLOTS - 1);
+    if( slot == 0 )
+    {
+      // the level 0 slots have come round, refill them from the next level up, and so on while those come round too
+      for(uint8_t level = 1; level < dtWHEEL_LEVELS; level++)
+      {
+        uint8_t upper = (tick >> (dtWHEEL_BITS * level)) & (dtWHEEL_SLOTS - 1);
+        cascade(level, upper);
+        if( upper != 0 )
+          break;
+      }
+    }
+    AlarmID_t id = head[slot];
+    head[slot] = dtINVALID_ALARM_ID;
+    while( id != dtINVALID_ALARM_ID )
+    {
+      AlarmID_t nextId = next[id];
+      link(id, dtWHEEL_DUE);
+      id = nextId;
+    }
+    tick++;
+  }
+}
+
+AlarmID_t TimerWheel::peekDue()
+{
+  return head[dtWHEEL_DUE];
+}
+
+bool TimerWheel::isEmpty()
+{
+  return size == 0;
+}
+
+// either the first occupied level 0 slot or the next time the upper levels are cascaded, whichever is first
+time_t TimerWheel::nextEvent()
+{
+  if( head[dtWHEEL_DUE] != dtINVALID_ALARM_ID )
+    return tick - 1;
+  uint32_t t = tick;
+  if( (t & (dtWHEEL_SLOTS - 1)) == 0 )
+    return t;  // the upper levels cascade before this second is expired
+  while( (t & (dtWHEEL_SLOTS - 1)) && head[t & (dtWHEEL_SLOTS - 1)] == dtINVALID_ALARM_ID )
+    t++;
+  return t;
+}
+
+time_t TimerWheel::nextTrigger()
+{
+  time_t next = 0;
+  bool found = false;
+  for(uint8_t id = 0; id < capacity; id++)
+  {
+    if( list[id] != dtWHEEL_NONE && ( ! found || alarms[id].nextTrigger < next ) )
+    {
+      next = alarms[id].nextTrigger;
+      found = true;
+    }
+  }
+  return next;
+}
+#endif
+
 //**************************************************************
 //* Time Alarms Public Methods
 
-TimeAlarmsClass::TimeAlarmsClass()
+// the slots are cleared by their own constructor, which runs after this one
+TimeAlarmsClass::TimeAlarmsClass(AlarmClass *alarms, AlarmID_t *queueIds, AlarmID_t *wheelLinks, uint8_t capacity) :
+  Alarm(alarms), capacity(capacity),
+  queue(alarms, queueIds, 1), msQueue(alarms, queueIds + capacity - 1, -1)
+#ifdef dtUSE_TIMER_WHEEL
+  , wheel(alarms, wheelLinks, capacity)
+#endif
+#ifdef dtUSE_TIMER_INTERRUPT
+  , isrQueue(alarms, queueIds + capacity, 1)
+#endif
 {
+  (void)wheelLinks;
   isServicing = false;
-  for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
-     free(id);   // ensure  all Alarms are cleared and available for allocation  
+  onIdleHandler = NULL;
+#ifdef dtUSE_TIMER_INTERRUPT
+  isArmed = isDue = isInterrupt = false;
+  nextInstance = firstInstance;
+  firstInstance = this;
+#endif
 }
 
 // this method creates a trigger at the given absolute time_t
@@ -121,7 +471,7 @@ AlarmID_t TimeAlarmsClass::triggerOnce(time_t value, OnTick_t onTickHandler){
 
 // this method will now return an error if the value is greater than one day - use DOW methods for weekly alarms   
 AlarmID_t TimeAlarmsClass::alarmOnce(time_t value, OnTick_t onTickHandler){   // trigger once at the given time of day
-     if( value <= SECS_PER_DAY)
+     if( value <= (time_t)SECS_PER_DAY)
         return create( value, onTickHandler, IS_ONESHOT, dtDailyAlarm );
      else
         return dtINVALID_ALARM_ID; // dont't allocate if the time is greater than one day 	  
@@ -137,7 +487,7 @@ AlarmID_t TimeAlarmsClass::alarmOnce(const timeDayOfWeek_t DOW, const int H,  co
    
 // this method will now return an error if the value is greater than one day - use DOW methods for weekly alarms   
 AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ // trigger daily at the given time
-    if( value <= SECS_PER_DAY)
+    if( value <= (time_t)SECS_PER_DAY)
        return create( value, onTickHandler, IS_REPEAT, dtDailyAlarm );
     else
        return dtINVALID_ALARM_ID; // dont't allocate if the time is greater than one day 	  
@@ -166,6 +516,87 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     AlarmID_t TimeAlarmsClass::timerRepeat(const int H,  const int M,  const int S, OnTick_t onTickHandler){ // trigger after the given number of seconds continuously
          return create( AlarmHMS(H,M,S), onTickHandler, IS_REPEAT, dtTimer);
     }
+    
+    AlarmID_t TimeAlarmsClass::timerOnceMs(unsigned long ms, OnTick_t onTickHandler){   // trigger once after the given number of milliseconds
+       if( ms <= dtMAX_VALUE)
+         return create( ms, onTickHandler, IS_ONESHOT, dtMillisTimer );
+       else
+         return dtINVALID_ALARM_ID; // don't allocate if the period does not fit in an alarm slot
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerRepeatMs(unsigned long ms, OnTick_t onTickHandler){ // trigger after the given number of milliseconds continuously
+       if( ms <= dtMAX_VALUE)
+         return create( ms, onTickHandler, IS_REPEAT, dtMillisTimer );
+       else
+         return dtINVALID_ALARM_ID;
+    }
+
+    AlarmID_t TimeAlarmsClass::triggerOnce(time_t value, OnTickContext_t onTickHandler, void *context){
+       if( value > 0)
+         return create( value, onTickHandler, context, IS_ONESHOT, dtExplicitAlarm );
+       else
+         return dtINVALID_ALARM_ID;
+    }
+    
+    AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTickContext_t onTickHandler, void *context){
+       if( value <= (time_t)SECS_PER_DAY)
+         return create( value, onTickHandler, context, IS_REPEAT, dtDailyAlarm );
+       else
+         return dtINVALID_ALARM_ID;
+    }
+    
+    AlarmID_t TimeAlarmsClass::alarmRepeat(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context){
+       return create( AlarmHMS(H,M,S), onTickHandler, context, IS_REPEAT, dtDailyAlarm );
+    }
+    
+    AlarmID_t TimeAlarmsClass::alarmRepeat(const timeDayOfWeek_t DOW, const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context){
+       return create( (DOW-1) * SECS_PER_DAY + AlarmHMS(H,M,S), onTickHandler, context, IS_REPEAT, dtWeeklyAlarm );
+    }
+    
+    AlarmID_t TimeAlarmsClass::alarmOnce(time_t value, OnTickContext_t onTickHandler, void *context){
+       if( value <= (time_t)SECS_PER_DAY)
+         return create( value, onTickHandler, context, IS_ONESHOT, dtDailyAlarm );
+       else
+         return dtINVALID_ALARM_ID;
+    }
+    
+    AlarmID_t TimeAlarmsClass::alarmOnce(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context){
+       return create( AlarmHMS(H,M,S), onTickHandler, context, IS_ONESHOT, dtDailyAlarm );
+    }
+    
+    AlarmID_t TimeAlarmsClass::alarmOnce(const timeDayOfWeek_t DOW, const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context){
+       return create( (DOW-1) * SECS_PER_DAY + AlarmHMS(H,M,S), onTickHandler, context, IS_ONESHOT, dtWeeklyAlarm );
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerOnce(time_t value, OnTickContext_t onTickHandler, void *context){
+       return create( value, onTickHandler, context, IS_ONESHOT, dtTimer );
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerOnce(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context){
+       return create( AlarmHMS(H,M,S), onTickHandler, context, IS_ONESHOT, dtTimer );
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerRepeat(time_t value, OnTickContext_t onTickHandler, void *context){
+       return create( value, onTickHandler, context, IS_REPEAT, dtTimer );
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerRepeat(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context){
+       return create( AlarmHMS(H,M,S), onTickHandler, context, IS_REPEAT, dtTimer );
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerOnceMs(unsigned long ms, OnTickContext_t onTickHandler, void *context){
+       if( ms <= dtMAX_VALUE)
+         return create( ms, onTickHandler, context, IS_ONESHOT, dtMillisTimer );
+       else
+         return dtINVALID_ALARM_ID;
+    }
+    
+    AlarmID_t TimeAlarmsClass::timerRepeatMs(unsigned long ms, OnTickContext_t onTickHandler, void *context){
+       if( ms <= dtMAX_VALUE)
+         return create( ms, onTickHandler, context, IS_REPEAT, dtMillisTimer );
+       else
+         return dtINVALID_ALARM_ID;
+    }
 
     const AlarmClass* TimeAlarmsClass::getAlarm(AlarmID_t ID) {
       if (isAllocated(ID))
@@ -174,19 +605,57 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
         return NULL;
     }
 
+#ifdef dtALARM_STATS
+    // free() leaves the stats alone and create() clears them, so a one shot alarm, which is freed
+    // before its handler runs, can still be read until its slot is reused
+    const AlarmStats_t* TimeAlarmsClass::getAlarmStats(AlarmID_t ID) {
+      if (ID < capacity)
+        return &Alarm[ID].stats;
+      else
+        return NULL;
+    }
+
+    void TimeAlarmsClass::resetAlarmStats(AlarmID_t ID) {
+      if (ID < capacity)
+        memset(&Alarm[ID].stats, 0, sizeof(AlarmStats_t));
+    }
+#endif
+
     
     void TimeAlarmsClass::enable(AlarmID_t ID)
     {
       if(isAllocated(ID)) {
-        Alarm[ID].Mode.isEnabled = (Alarm[ID].value != 0) && (Alarm[ID].onTickHandler != 0) ;  // only enable if value is non zero and a tick handler has been set
+        uint8_t sreg = dtLock(Alarm[ID].Mode.isIsrSafe);  // the interrupt may be triggering this timer
+        Alarm[ID].Mode.isEnabled = (Alarm[ID].getValue() != 0) && (Alarm[ID].onTickHandler != 0) ;  // only enable if value is non zero and a tick handler has been set
         Alarm[ID].updateNextTrigger(); // trigger is updated whenever  this is called, even if already enabled	 
+        schedule(ID);
+        dtUnlock(sreg);
       }
     }
     
     void TimeAlarmsClass::disable(AlarmID_t ID)
     {
-      if(isAllocated(ID))
+      if(isAllocated(ID)) {
+        uint8_t sreg = dtLock(Alarm[ID].Mode.isIsrSafe);
         Alarm[ID].Mode.isEnabled = false;
+        unschedule(ID);
+        dtUnlock(sreg);
+      }
+    }
+    
+    // only millisecond timers can be triggered from the interrupt, their triggers do not need now()
+    // the handler is called with interrupts disabled and must be short, it may only change its own timer
+    bool TimeAlarmsClass::setIsrSafe(AlarmID_t ID)
+    {
+      if(isAllocated(ID) && Alarm[ID].Mode.alarmType == dtMillisTimer) {
+        uint8_t sreg = dtLock(true);
+        unschedule(ID);
+        Alarm[ID].Mode.isIsrSafe = true;
+        schedule(ID);
+        dtUnlock(sreg);
+        return true;
+      }
+      return false;
     }
       
     // write the given value to the given alarm
@@ -194,8 +663,10 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     {
       if(isAllocated(ID))
       {
-        Alarm[ID].value = value;
-        enable(ID);  // update trigger time
+        uint8_t sreg = dtLock(Alarm[ID].Mode.isIsrSafe);
+        if(Alarm[ID].setValue(value))
+          enable(ID);  // update trigger time
+        dtUnlock(sreg);
       }
     }
     
@@ -203,7 +674,7 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     time_t TimeAlarmsClass::read(AlarmID_t ID)
     {
       if(isAllocated(ID))
-        return Alarm[ID].value ;
+        return Alarm[ID].getValue() ;
       else 	
         return dtINVALID_TIME;  
     }
@@ -221,11 +692,17 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     {
       if(isAllocated(ID))
       {
+        uint8_t sreg = dtLock(Alarm[ID].Mode.isIsrSafe);
+        unschedule(ID);
         Alarm[ID].Mode.isEnabled = false;
     	Alarm[ID].Mode.alarmType = dtNotAllocated;
+        Alarm[ID].Mode.hasContext = false;
+        Alarm[ID].Mode.isIsrSafe = false;
         Alarm[ID].onTickHandler = 0;
+        Alarm[ID].context = NULL;
     	Alarm[ID].value = 0;
     	Alarm[ID].nextTrigger = 0;   	
+        dtUnlock(sreg);
       }
     }
     
@@ -233,7 +710,7 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     uint8_t TimeAlarmsClass::count()
     {
        uint8_t c = 0; 
-       for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
+       for(uint8_t id = 0; id < capacity; id++)
        {
           if(isAllocated(id))
             c++;
@@ -250,13 +727,17 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
      // returns true if this id is allocated
      bool TimeAlarmsClass::isAllocated(AlarmID_t ID)
      {
-        return( ID < dtNBR_ALARMS && Alarm[ID].Mode.alarmType != dtNotAllocated );
+        return( ID < capacity && Alarm[ID].Mode.alarmType != dtNotAllocated );
      }
      
     
     AlarmID_t TimeAlarmsClass::getTriggeredAlarmId()  //returns the currently triggered  alarm id
     // returns  dtINVALID_ALARM_ID if not invoked from within an alarm handler
     {
+#ifdef dtUSE_TIMER_INTERRUPT
+      if(isInterrupt)
+           return  servicedAlarmId;
+#endif
       if(isServicing)
            return  servicedAlarmId;  // new private data member used instead of local loop variable i in serviceAlarms();
       else
@@ -267,8 +748,40 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     void TimeAlarmsClass::delay(unsigned long ms)
     {
       unsigned long start = millis();
-      while( millis() - start  <= ms)
+      unsigned long elapsed;
+      while( (elapsed = millis() - start)  <= ms)
+      {
         serviceAlarms();
+        if( onIdleHandler != NULL )
+        {
+          unsigned long idle = ms - elapsed + 1;  // the delay ends once more than ms have elapsed
+          unsigned long untilAlarm = msUntilNextTrigger();
+          if( untilAlarm < idle )
+            idle = untilAlarm;
+          if( idle > 0 )
+            (*onIdleHandler)(idle);
+        }
+      }
+    }
+    
+    void TimeAlarmsClass::service()
+    {
+      serviceAlarms();
+    }
+    
+    // without the timer interrupt this is a service pass, which is cheap when nothing is due
+    void TimeAlarmsClass::serviceDue()
+    {
+#ifdef dtUSE_TIMER_INTERRUPT
+      if(! isDue)
+        return;
+#endif
+      serviceAlarms();
+    }
+    
+    void TimeAlarmsClass::setIdleHandler(OnIdle_t onIdleHandler)
+    {
+      this->onIdleHandler = onIdleHandler;
     }
     		
     void TimeAlarmsClass::waitForDigits( uint8_t Digits, dtUnits_t Units)
@@ -299,51 +812,227 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     //***********************************************************
     //* Private Methods
     
+    // keep the queues holding exactly the enabled alarms, ordered on their current nextTrigger
+    void TimeAlarmsClass::schedule(AlarmID_t ID)
+    {
+      unschedule(ID);
+      if(Alarm[ID].Mode.isEnabled)
+      {
+#ifdef dtUSE_TIMER_INTERRUPT
+        if(Alarm[ID].Mode.isIsrSafe)
+        {
+          isrQueue.insert(ID);  // the interrupt checks these itself, the deadline is unchanged
+          return;
+        }
+#endif
+        if(Alarm[ID].Mode.alarmType == dtMillisTimer)
+          msQueue.insert(ID);
+#ifdef dtUSE_TIMER_WHEEL
+        else if(Alarm[ID].Mode.alarmType == dtTimer)
+        {
+          wheel.advance(now());  // timers are placed relative to the wheel's current second
+          wheel.insert(ID);
+        }
+#endif
+        else
+          queue.insert(ID);
+      }
+#ifdef dtUSE_TIMER_INTERRUPT
+      if(isInterrupt)
+        isDue = true;  // an ISR safe handler changed another alarm, have the sketch recompute the deadline
+      else if(! isServicing)
+        armInterrupt();
+#endif
+    }
+    
+    void TimeAlarmsClass::unschedule(AlarmID_t ID)
+    {
+#ifdef dtUSE_TIMER_INTERRUPT
+      if(Alarm[ID].Mode.isIsrSafe)
+        isrQueue.remove(ID);
+      else
+#endif
+      if(Alarm[ID].Mode.alarmType == dtMillisTimer)
+        msQueue.remove(ID);
+#ifdef dtUSE_TIMER_WHEEL
+      else if(Alarm[ID].Mode.alarmType == dtTimer)
+        wheel.remove(ID);
+#endif
+      else
+        queue.remove(ID);
+    }
+    
+    // only the alarms at the front of the queues need checking
+    AlarmID_t TimeAlarmsClass::nextDue()
+    {
+      AlarmID_t id = msQueue.peek();
+      if( id != dtINVALID_ALARM_ID && ! dtBefore(millis(), Alarm[id].nextTrigger) )
+        return id;
+#ifdef dtUSE_TIMER_WHEEL
+      wheel.advance(now());
+      id = wheel.peekDue();
+      if( id != dtINVALID_ALARM_ID )
+        return id;
+#endif
+      id = queue.peek();
+      if( id != dtINVALID_ALARM_ID && now() >= Alarm[id].nextTrigger )
+        return id;
+      return dtINVALID_ALARM_ID;
+    }
+    
+    // the pass ends when neither queue has an alarm due
     void TimeAlarmsClass::serviceAlarms()
     {
       if(! isServicing)
       {
         isServicing = true;
-        for( servicedAlarmId = 0; servicedAlarmId < dtNBR_ALARMS; servicedAlarmId++)
+#ifdef dtUSE_TIMER_INTERRUPT
+        isDue = false;
+#endif
+        while( (servicedAlarmId = nextDue()) != dtINVALID_ALARM_ID )
         {
-          if( Alarm[servicedAlarmId].Mode.isEnabled && (now() >= Alarm[servicedAlarmId].nextTrigger)  )
-          {
-            OnTick_t TickHandler = Alarm[servicedAlarmId].onTickHandler;
-            if(Alarm[servicedAlarmId].Mode.isOneShot)
-               free(servicedAlarmId);  // free the ID if mode is OnShot		
-            else   
-               Alarm[servicedAlarmId].updateNextTrigger();
-            if( TickHandler != NULL) {        
+          OnTick_t TickHandler = Alarm[servicedAlarmId].onTickHandler;
+          void *context = Alarm[servicedAlarmId].context;
+          bool hasContext = Alarm[servicedAlarmId].Mode.hasContext;
+#ifdef dtALARM_STATS
+          AlarmStats_t *stats = &Alarm[servicedAlarmId].stats;
+          Alarm[servicedAlarmId].recordTrigger();
+          unsigned long triggers = stats->count;
+          unsigned long started = micros();
+#endif
+          if(Alarm[servicedAlarmId].Mode.isOneShot)
+             free(servicedAlarmId);  // free the ID if mode is OnShot		
+          else {
+             Alarm[servicedAlarmId].updateNextTrigger();
+             schedule(servicedAlarmId);
+          }
+          if( TickHandler != NULL) {        
+            if( hasContext )
+              (*(OnTickContext_t)TickHandler)(context);
+            else
               (*TickHandler)();     // call the handler  
-            }
           }
+#ifdef dtALARM_STATS
+          if( stats->count == triggers )  // the handler did not free the slot and create a new alarm in it
+          {
+            stats->lastRunTime = micros() - started;
+            if( stats->lastRunTime > stats->maxRunTime )
+              stats->maxRunTime = stats->lastRunTime;
+          }
+#endif
         }
         isServicing = false;
+#ifdef dtUSE_TIMER_INTERRUPT
+        armInterrupt();
+#endif
       }
     }
     
-    // returns the absolute time of the next scheduled alarm, or 0 if none
+#ifdef dtUSE_TIMER_INTERRUPT
+    TimeAlarmsClass *TimeAlarmsClass::firstInstance = NULL;
+    
+    // the deadline is when the next alarm is due, as far as millis() and the phase of now() can tell
+    void TimeAlarmsClass::armInterrupt()
+    {
+      unsigned long ms = msUntilNextTrigger();
+      uint8_t sreg = dtLock(true);
+      interruptDeadline = millis() + ms;
+      isArmed = ms != 0xffffffff;
+#if defined(__AVR__)
+      TIMSK0 |= _BV(OCIE0A);  // timer 0 also drives millis(), its compare interrupt runs once per overflow
+#endif
+      dtUnlock(sreg);
+    }
+    
+    void TimeAlarmsClass::interrupt()
+    {
+      unsigned long ms = millis();
+      AlarmID_t id;
+      while( (id = isrQueue.peek()) != dtINVALID_ALARM_ID && ! dtBefore(ms, Alarm[id].nextTrigger) )
+      {
+        OnTick_t TickHandler = Alarm[id].onTickHandler;
+        void *context = Alarm[id].context;
+        bool hasContext = Alarm[id].Mode.hasContext;
+        if(Alarm[id].Mode.isOneShot)
+          free(id);
+        else {
+          Alarm[id].updateNextTrigger();
+          schedule(id);
+        }
+        AlarmID_t servicing = servicedAlarmId;  // the sketch may be in the middle of a handler
+        servicedAlarmId = id;
+        isInterrupt = true;
+        if( hasContext )
+          (*(OnTickContext_t)TickHandler)(context);
+        else
+          (*TickHandler)();
+        isInterrupt = false;
+        servicedAlarmId = servicing;
+      }
+      if( isArmed && ! dtBefore(ms, interruptDeadline) )
+      {
+        isArmed = false;
+        isDue = true;  // serviceDue or delay will trigger the alarms
+      }
+    }
+#endif
+    
+    // returns the absolute time of the next enabled alarm, or 0 if none
      time_t TimeAlarmsClass::getNextTrigger()
      {
-     time_t nextTrigger = 0xffffffff;  // the max time value
-     
-        for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
-        {
-          if(isAllocated(id) )
-          {
-        	if(Alarm[id].nextTrigger <  nextTrigger)
-    		   nextTrigger = Alarm[id].nextTrigger;	
-          }      
-    	}
-        return nextTrigger == 0xffffffff ? 0 : nextTrigger;  	
+        AlarmID_t id = queue.peek();
+        time_t nextTrigger = id == dtINVALID_ALARM_ID ? 0 : Alarm[id].nextTrigger;
+#ifdef dtUSE_TIMER_WHEEL
+        if( ! wheel.isEmpty() && (nextTrigger == 0 || wheel.nextTrigger() < nextTrigger) )
+          nextTrigger = wheel.nextTrigger();
+#endif
+        return nextTrigger;
      }
     
+    // returns 0 if an alarm is due, 0xffffffff if none is enabled
+    unsigned long TimeAlarmsClass::msUntilNextTrigger()
+    {
+      unsigned long ms = 0xffffffff;
+      AlarmID_t id = queue.peek();
+      bool found = id != dtINVALID_ALARM_ID;
+      time_t next = found ? Alarm[id].nextTrigger : 0;
+#ifdef dtUSE_TIMER_WHEEL
+      if( ! wheel.isEmpty() )
+      {
+        time_t wheelNext = wheel.nextEvent();
+        if( ! found || wheelNext < next )
+          next = wheelNext;
+        found = true;
+      }
+#endif
+      if( found )
+      {
+        uint16_t phase;  // the milliseconds already gone in the current second
+        time_t time = nowMillis(phase);
+        if( next <= time )
+          return 0;
+        unsigned long secs = next - time;
+        if( secs <= 0xffffffff / 1000 )
+          ms = secs * 1000 - phase;
+      }
+      id = msQueue.peek();
+      if( id != dtINVALID_ALARM_ID )
+      {
+        long untilTimer = (int32_t)((uint32_t)Alarm[id].nextTrigger - (uint32_t)millis());
+        if( untilTimer <= 0 )
+          return 0;
+        if( (unsigned long)untilTimer < ms )
+          ms = untilTimer;
+      }
+      return ms;
+    }
+    
     // attempt to create an alarm and return true if successful
     AlarmID_t TimeAlarmsClass::create( time_t value, OnTick_t onTickHandler, uint8_t isOneShot, dtAlarmPeriod_t alarmType, uint8_t isEnabled) 
     {
-      if( ! (dtIsAlarm(alarmType) && now() < SECS_PER_YEAR)) // only create alarm ids if the time is at least Jan 1 1971
+      if( ! (dtIsAlarm(alarmType) && now() < (time_t)SECS_PER_YEAR)) // only create alarm ids if the time is at least Jan 1 1971
       {  
-    	for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
+    	for(uint8_t id = 0; id < capacity; id++)
         {
           if( Alarm[id].Mode.alarmType == dtNotAllocated )
     	  {
@@ -351,7 +1040,15 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
       	    Alarm[id].onTickHandler = onTickHandler;
     	    Alarm[id].Mode.isOneShot = isOneShot;
     	    Alarm[id].Mode.alarmType = alarmType;
-    	    Alarm[id].value = value;
+    	    Alarm[id].Mode.hasContext = false;
+#ifdef dtALARM_STATS
+    	    resetAlarmStats(id);
+#endif
+    	    if( ! Alarm[id].setValue(value) )
+    	    {
+    	      free(id);
+    	      break;  // the value does not fit in a slot
+    	    }
     	    isEnabled ?  enable(id) : disable(id);
             return id;  // alarm created ok
     	  }  
@@ -360,6 +1057,42 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
       return dtINVALID_ALARM_ID; // no IDs available or time is invalid
     }
     
+    // as above, the handler is stored as an OnTick_t and cast back when it is called
+    AlarmID_t TimeAlarmsClass::create( time_t value, OnTickContext_t onTickHandler, void *context, uint8_t isOneShot, dtAlarmPeriod_t alarmType)
+    {
+      AlarmID_t id = create( value, (OnTick_t)onTickHandler, isOneShot, alarmType, false);
+      if( id != dtINVALID_ALARM_ID )
+      {
+        Alarm[id].context = context;
+        Alarm[id].Mode.hasContext = true;
+        enable(id);
+      }
+      return id;
+    }
+    
+#if defined(__AVR__)
+    // idle mode stops the cpu clock but leaves the timers, SPI, UART and external interrupts running,
+    // so the timer0 tick behind millis() or an interrupt from another peripheral wakes us within a millisecond
+    void dtIdleSleep(unsigned long ms)
+    {
+      (void)ms;
+      set_sleep_mode(SLEEP_MODE_IDLE);
+      sleep_enable();
+      sleep_cpu();
+      sleep_disable();
+    }
+#endif
+    
+#ifndef dtNO_DEFAULT_ALARMS
     // make one instance for the user to use
-    TimeAlarmsClass Alarm = TimeAlarmsClass() ;
+    TimeAlarms<dtNBR_ALARMS> Alarm;
+#endif
+
+#if defined(dtUSE_TIMER_INTERRUPT) && defined(__AVR__)
+ISR(TIMER0_COMPA_vect)
+{
+  for(TimeAlarmsClass *alarms = TimeAlarmsClass::firstInstance; alarms != NULL; alarms = alarms->nextInstance)
+    alarms->interrupt();
+}
+#endif
 
@@ -7,10 +7,20 @@
 
 #include "Time.h"
 
-#define dtNBR_ALARMS 20   // max is 255
+#ifndef dtNBR_ALARMS
+#define dtNBR_ALARMS 20   // the number of alarms in the default Alarm instance, max is 255
+#endif
 
 #define USE_SPECIALIST_METHODS  // define this for testing
 
+//#define dtNO_DEFAULT_ALARMS  // define this to leave out the default Alarm instance, a sketch can then declare its own TimeAlarms<N>
+
+//#define dtUSE_TIMER_WHEEL  // define this to keep timers in a timing wheel, worthwhile with many short timers
+
+//#define dtALARM_STATS  // define this to record how late each alarm is serviced and how long its handler runs
+
+//#define dtUSE_TIMER_INTERRUPT  // define this to have the timer 0 compare interrupt mark alarms due (AVR only)
+
 typedef enum { dtMillisecond, dtSecond, dtMinute, dtHour, dtDay } dtUnits_t;
 
 typedef struct  {
@@ -18,12 +28,15 @@ typedef struct  {
 	                                     // note that the current API only supports daily or weekly alarm periods
     uint8_t isEnabled              :1 ;  // the timer is only actioned if isEnabled is true 
     uint8_t isOneShot              :1 ;  // the timer will be de-allocated after trigger is processed 
+    uint8_t hasContext             :1 ;  // the handler is an OnTickContext_t and is called with the context
+    uint8_t isIsrSafe              :1 ;  // a millisecond timer whose handler may be called from the timer interrupt
 										 }
     AlarmMode_t   ;
 	
 // new time based alarms should be added just before dtLastAlarmType
-typedef enum  {dtNotAllocated, dtTimer, dtExplicitAlarm, dtDailyAlarm, dtWeeklyAlarm, dtLastAlarmType } dtAlarmPeriod_t ; // in future: dtBiweekly, dtMonthly, dtAnnual
+typedef enum  {dtNotAllocated, dtTimer, dtMillisTimer, dtExplicitAlarm, dtDailyAlarm, dtWeeklyAlarm, dtLastAlarmType } dtAlarmPeriod_t ; // in future: dtBiweekly, dtMonthly, dtAnnual
 
+// dtMillisTimer values and triggers are in millis() rather than now() seconds
 // macro to return true if the given type is a time based alarm, false if timer or not allocated
 #define dtIsAlarm(_type_)  (_type_ >= dtExplicitAlarm && _type_ < dtLastAlarmType) 
 
@@ -32,36 +45,168 @@ typedef AlarmID_t AlarmId;  // Arduino friendly name
 
 #define dtINVALID_ALARM_ID 255
 #define dtINVALID_TIME     0L
+#define dtMAX_VALUE        0xffffffUL  // the largest timer period (or millisecond period) an alarm slot can hold
+
+#ifdef dtALARM_STATS
+// what has happened to an alarm since it was created, times are measured when the alarm is serviced
+// lateness is in milliseconds, but only has a resolution of one second for alarms that are not millisecond timers
+typedef struct {
+  unsigned long count;        // number of times the alarm was triggered
+  uint16_t misses;            // periods of a repeating alarm that passed without a trigger because it was serviced late
+  unsigned long lastLateness; // milliseconds between the trigger time and when the alarm was serviced
+  unsigned long maxLateness;
+  unsigned long lastRunTime;  // microseconds spent in the handler
+  unsigned long maxRunTime;
+} AlarmStats_t;
+#endif
 
 class AlarmClass;  // forward reference
 typedef void (*OnTick_t)();  // alarm callback function typedef 
+typedef void (*OnTickContext_t)(void *context);  // alarm callback that is passed the context given when the alarm was created
+typedef void (*OnIdle_t)(unsigned long ms);  // idle callback, ms is how long the scheduler has nothing to do
+
+#if defined(__AVR__)
+void dtIdleSleep(unsigned long ms);  // idle handler that sleeps the cpu until the next interrupt
+#endif
 
 // class defining an alarm instance, only used by dtAlarmsClass
+// value shares a 32 bit word with Mode: a time of day or week needs at most 20 bits and timer periods are
+// limited to dtMAX_VALUE, explicit alarms keep their date and time in nextTrigger alone
 class AlarmClass
 {  
 private:
 
 public:
   AlarmClass(); 
-  OnTick_t onTickHandler; 
+  OnTick_t onTickHandler;   // holds an OnTickContext_t if Mode.hasContext is set
+  void *context;
   void updateNextTrigger();
-  time_t value;
+  time_t getValue();
+  bool setValue(time_t value);  // returns false if the value does not fit this type of alarm
+#ifdef dtALARM_STATS
+  void recordTrigger();         // called when the alarm is serviced, before nextTrigger is updated
+  AlarmStats_t stats;
+#endif
   time_t nextTrigger;
+  uint32_t value :24;
   AlarmMode_t Mode;
+  uint8_t queuePos;             // position in the AlarmQueue holding the alarm, only meaningful while it is queued
+};
+
+// min-heap of the enabled alarm ids ordered on nextTrigger, only used by TimeAlarmsClass
+// the earliest trigger is always at the front so a service pass with nothing due is O(1)
+// two queues can share one array, the second filling it from the end, as an alarm is only ever in one of them
+class AlarmQueue
+{
+private:
+  AlarmClass *alarms;                       // the alarm slots the ids refer to
+  AlarmID_t *ids;                           // heap position 0
+  int8_t step;                              // 1 if the heap grows up from ids, -1 if it grows down
+  uint8_t size;
+  AlarmID_t& at(uint8_t pos);
+  bool before(uint8_t i, uint8_t j);        // true if the alarm at heap position i triggers before the one at j
+  void swap(uint8_t i, uint8_t j);
+  void siftUp(uint8_t pos);
+  void siftDown(uint8_t pos);
+
+public:
+  AlarmQueue(AlarmClass *alarms, AlarmID_t *ids, int8_t step);
+  void insert(AlarmID_t ID);                // add the id, its nextTrigger must already be set
+  void remove(AlarmID_t ID);                // remove the id if it is queued, O(log n) using the alarm's queuePos
+  AlarmID_t peek();                         // the id with the earliest trigger, dtINVALID_ALARM_ID if empty
+};
+
+#ifdef dtUSE_TIMER_WHEEL
+#define dtWHEEL_LEVELS  4                     // each level spans dtWHEEL_SLOTS times the level below
+#define dtWHEEL_BITS    4
+#define dtWHEEL_SLOTS   (1 << dtWHEEL_BITS)
+#define dtWHEEL_SPAN    (1UL << (dtWHEEL_LEVELS * dtWHEEL_BITS))  // seconds ahead the wheel can hold directly
+#define dtWHEEL_DUE     (dtWHEEL_LEVELS * dtWHEEL_SLOTS)         // the list of expired timers, after the slots
+#define dtWHEEL_NONE    255                   // list value of a timer that is not in the wheel
+
+// hierarchical timing wheel of the enabled dtTimer alarms, only used by TimeAlarmsClass
+// level 0 has a slot per second for the next 16 seconds, each level above has slots 16 times wider,
+// timers move down a level when their slot comes round so insert, remove and expire are all O(1)
+class TimerWheel
+{
+private:
+  AlarmClass *alarms;
+  uint8_t capacity;
+  uint32_t tick;                            // every second before this one has been expired
+  uint8_t size;
+  AlarmID_t head[dtWHEEL_DUE + 1];          // doubly linked list per slot, plus the due list
+  AlarmID_t *next;                          // these three point into the storage of TimeAlarms<N>
+  AlarmID_t *prev;
+  uint8_t *list;                            // the list each timer is on
+  void link(AlarmID_t ID, uint8_t l);
+  void unlink(AlarmID_t ID);
+  void place(AlarmID_t ID);                 // link the timer on the list for its nextTrigger
+  void cascade(uint8_t level, uint8_t slot);   // re-place the timers of a slot on the levels below
+  void rebase(uint32_t time);               // re-place every timer after the clock jumped
+
+public:
+  TimerWheel(AlarmClass *alarms, AlarmID_t *links, uint8_t capacity);  // links holds 3 * capacity bytes
+  void insert(AlarmID_t ID);                // add the id, its nextTrigger must already be set
+  void remove(AlarmID_t ID);                // remove the id if it is in the wheel
+  void advance(time_t time);                // expire the timers due at or before the given time
+  AlarmID_t peekDue();                      // an expired timer, dtINVALID_ALARM_ID if none
+  bool isEmpty();
+  time_t nextEvent();                       // a time no later than the next expiry, only valid if not empty
+  time_t nextTrigger();                     // the earliest nextTrigger in the wheel, only valid if not empty
 };
+#endif
 
-// class containing the collection of alarms
+#ifdef dtUSE_TIMER_WHEEL
+#define dtWHEEL_LINKS(_n_)  (3 * (_n_))
+#else
+#define dtWHEEL_LINKS(_n_)  0
+#endif
+
+#ifdef dtUSE_TIMER_INTERRUPT
+#define dtISR_IDS(_n_)  (_n_)
+#else
+#define dtISR_IDS(_n_)  0
+#endif
+
+// class containing the collection of alarms, the storage for them is provided by TimeAlarms<N> below
 class TimeAlarmsClass
 {
 private:
-   AlarmClass Alarm[dtNBR_ALARMS];
+   AlarmClass *Alarm;
+   uint8_t capacity;
+   AlarmQueue queue;         // the enabled alarms, earliest trigger first
+   AlarmQueue msQueue;       // as above for the millisecond timers, which run on millis() instead of now()
+#ifdef dtUSE_TIMER_WHEEL
+   TimerWheel wheel;         // the enabled dtTimer alarms, these are not in queue
+#endif
+#ifdef dtUSE_TIMER_INTERRUPT
+   AlarmQueue isrQueue;      // the enabled ISR safe millisecond timers, only these are triggered by the interrupt
+   volatile bool isArmed;    // the interrupt sets isDue once millis() reaches interruptDeadline
+   volatile bool isDue;
+   volatile bool isInterrupt;  // an ISR safe handler is running
+   volatile unsigned long interruptDeadline;
+   void armInterrupt();      // recompute the deadline after the alarms changed, not called from the interrupt
+#endif
+   AlarmID_t nextDue();      // the first alarm due, dtINVALID_ALARM_ID if none
+   void schedule(AlarmID_t ID);  // (re)queue the alarm after its enabled state or trigger changed
+   void unschedule(AlarmID_t ID);
    void serviceAlarms();
    uint8_t isServicing;
    uint8_t servicedAlarmId; // the alarm currently being serviced
+   OnIdle_t onIdleHandler;  // called from delay when no alarm is due, NULL to busy wait
+   unsigned long msUntilNextTrigger(); // lower bound on the ms before the next alarm is due
    AlarmID_t create( time_t value, OnTick_t onTickHandler, uint8_t isOneShot, dtAlarmPeriod_t alarmType, uint8_t isEnabled=true);
+   AlarmID_t create( time_t value, OnTickContext_t onTickHandler, void *context, uint8_t isOneShot, dtAlarmPeriod_t alarmType);
    
+protected:
+  TimeAlarmsClass(AlarmClass *alarms, AlarmID_t *queueIds, AlarmID_t *wheelLinks, uint8_t capacity);
+
 public:
-  TimeAlarmsClass();
+#ifdef dtUSE_TIMER_INTERRUPT
+  static TimeAlarmsClass *firstInstance;  // all the instances are serviced by the interrupt
+  TimeAlarmsClass *nextInstance;
+  void interrupt();                         // called from the timer interrupt, about once a millisecond
+#endif
   // functions to create alarms and timers
 
   AlarmID_t triggerOnce(time_t value, OnTick_t onTickHandler);   // trigger once at the given time_t
@@ -79,8 +224,28 @@ public:
   
   AlarmID_t timerRepeat(time_t value, OnTick_t onTickHandler); // trigger after the given number of seconds continuously
   AlarmID_t timerRepeat(const int H,  const int M,  const int S, OnTick_t onTickHandler);   // As above with HMS arguments
+
+  AlarmID_t timerOnceMs(unsigned long ms, OnTick_t onTickHandler);    // trigger once after the given number of milliseconds
+  AlarmID_t timerRepeatMs(unsigned long ms, OnTick_t onTickHandler);  // trigger after the given number of milliseconds continuously
+
+  // as above, calling the handler with the given context, so one handler can serve several alarms or step through a sequence
+  AlarmID_t triggerOnce(time_t value, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t alarmRepeat(time_t value, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t alarmRepeat(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t alarmRepeat(const timeDayOfWeek_t DOW, const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t alarmOnce(time_t value, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t alarmOnce( const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t alarmOnce(const timeDayOfWeek_t DOW, const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t timerOnce(time_t value, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t timerOnce(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t timerRepeat(time_t value, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t timerRepeat(const int H,  const int M,  const int S, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t timerOnceMs(unsigned long ms, OnTickContext_t onTickHandler, void *context);
+  AlarmID_t timerRepeatMs(unsigned long ms, OnTickContext_t onTickHandler, void *context);
   
   void delay(unsigned long ms);
+  void serviceDue();                        // trigger the alarms that are due without waiting, for code that keeps the sketch from calling delay
+  void setIdleHandler(OnIdle_t onIdleHandler);  // idle the cpu with this handler between alarms in delay
    
   // utility methods
   uint8_t getDigitsNow( dtUnits_t Units);         // returns the current digit value for the given time unit
@@ -89,8 +254,13 @@ public:
  
   // low level methods 
   const AlarmClass* getAlarm(AlarmID_t ID);
+#ifdef dtALARM_STATS
+  const AlarmStats_t* getAlarmStats(AlarmID_t ID);  // returns NULL if the id is out of range, a freed id keeps its stats until reused
+  void resetAlarmStats(AlarmID_t ID);
+#endif
   void enable(AlarmID_t ID);                // enable the alarm to trigger
   void disable(AlarmID_t ID);               // prevent the alarm from triggering   
+  bool setIsrSafe(AlarmID_t ID);            // let the timer interrupt call the handler of this millisecond timer directly
   AlarmID_t getTriggeredAlarmId();          // returns the currently triggered  alarm id
   void write(AlarmID_t ID, time_t value);   // write the value (and enable) the alarm with the given ID  
   time_t read(AlarmID_t ID);                // return the value for the given timer  
@@ -100,13 +270,29 @@ public:
 private:  // the following methods are for testing and are not documented as part of the standard library
 #endif
   void free(AlarmID_t ID);                  // free the id to allow its reuse 
+  void service();                           // make a single pass over the due alarms without waiting
   uint8_t count();                          // returns the number of allocated timers
-  time_t getNextTrigger();                  // returns the time of the next scheduled alarm
+  time_t getNextTrigger();                  // returns the time of the next enabled alarm, millisecond timers are not included
   bool isAllocated(AlarmID_t ID);           // returns true if this id is allocated  
   bool isAlarm(AlarmID_t ID);               // returns true if id is for a time based alarm, false if its a timer or not allocated
 };
 
-extern TimeAlarmsClass Alarm;  // make an instance for the user
+// a collection of N alarms, sized for the sketch at compile time
+template <uint8_t N>  // max is 255
+class TimeAlarms : public TimeAlarmsClass
+{
+private:
+  AlarmClass slots[N];
+  AlarmID_t queueIds[N + dtISR_IDS(N)];   // shared by the seconds and millisecond queues, then the ISR queue
+  AlarmID_t wheelLinks[dtWHEEL_LINKS(N) + 1];
+
+public:
+  TimeAlarms() : TimeAlarmsClass(slots, queueIds, wheelLinks, N) {}
+};
+
+#ifndef dtNO_DEFAULT_ALARMS
+extern TimeAlarms<dtNBR_ALARMS> Alarm;  // make an instance for the user
+#endif
 
 /*==============================================================================
  * MACROS
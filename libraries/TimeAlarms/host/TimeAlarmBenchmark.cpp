@@ -0,0 +1,316 @@
+// Replays days of alarms, timers and clock syncs against a virtual clock on the host
+// and reports what it costs to service them:
+//   - the time taken by a service pass with nothing due and by one that triggers alarms
+//   - how many milliseconds after their scheduled time the alarms and timers were triggered
+//   - the clock error found at each sync and the drift the discipline estimated
+//   - the time taken by breakTime and makeTime, and any day from 1970 to 2106 that does
+//     not survive a round trip, which makes the run fail
+//
+//   TimeAlarmBenchmark [--days N] [--drift PPM] [--seed N]
+//
+// millis() is the board's clock, it runs --drift parts per million fast (or slow) against
+// the true clock that syncs are answered from. Between service passes the sketch is away
+// for a random 1 to LOOP_MS milliseconds of virtual time, and a week replays in seconds.
+// The times are host CPU time, not the AVR's, so compare runs made on the same machine
+// before and after changing the libraries.
+#include <stdio.h>
+#include <time.h>
+
+#include <Arduino.h>
+#include <Time.h>
+#include <TimeAlarms.h>
+
+#define LOOP_MS         20      // most virtual ms the sketch spends between service passes
+#define SYNC_INTERVAL   300     // seconds between syncs, the discipline stretches this to MAX_SYNC_INTERVAL
+#define MAX_SYNC_INTERVAL 14400
+#define CONVERSIONS     1000000 // number of breakTime and makeTime calls to time
+#define CONVERSION_STEP (0xffffffffUL / CONVERSIONS)  // spreads them over the whole range of time_t
+
+enum { kindTimer, kindOnce, kindDaily, kindWeekly, kindMillis };
+
+uint64_t trueMicros;             // virtual time since the start, on the true clock
+long driftPpm = 0;
+time_t startTime;                // the true time at the start
+
+uint8_t kind[dtNBR_ALARMS];
+uint64_t due[dtNBR_ALARMS];      // when each timer should next trigger, in ms of now() or millis()
+
+unsigned long passes, idlePasses, firingPasses, syncs;
+double idleNanos, idleMaxNanos, firingNanos, firingMaxNanos;
+unsigned long fired, firedMillis, early;
+double lateTotal, lateMillisTotal;
+long lateMax, lateMillisMax;
+long syncErrorMax;
+double syncErrorTotal;
+
+// the board's clock, which wraps at 32 bits like the AVR's
+unsigned long millis()
+{
+  uint64_t us = trueMicros + (int64_t)trueMicros * driftPpm / 1000000;
+  return (uint32_t)(us / 1000);
+}
+
+unsigned long micros()
+{
+  uint64_t us = trueMicros + (int64_t)trueMicros * driftPpm / 1000000;
+  return (uint32_t)us;
+}
+
+void delay(unsigned long ms)
+{
+  trueMicros += ms * 1000ULL;
+}
+
+double hostNanos()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// now() in ms, with the milliseconds of the current second
+int64_t nowMs()
+{
+  uint16_t ms;
+  time_t t = nowMillis(ms);
+  return (int64_t)t * 1000 + ms;
+}
+
+// the time server, answers at once with the true time
+bool requestSync()
+{
+  return true;
+}
+
+timeSyncResult_t pollSync(time_t &t, uint16_t &ms)
+{
+  uint64_t trueMs = trueMicros / 1000;
+  t = startTime + trueMs / 1000;
+  ms = trueMs % 1000;
+  if(syncs++ > 0)
+  {
+    // how far the board's clock has run from the true one since the last sync
+    long error = labs((long)(nowMs() - ((int64_t)t * 1000 + ms)));
+    syncErrorTotal += error;
+    if(error > syncErrorMax)
+      syncErrorMax = error;
+  }
+  return timeSyncDone;
+}
+
+void recordLateness(long late, bool isMillis)
+{
+  if(late < 0)
+  {
+    early++;  // a sync set the clock back past the trigger time
+    return;
+  }
+  if(isMillis)
+  {
+    firedMillis++;
+    lateMillisTotal += late;
+    if(late > lateMillisMax)
+      lateMillisMax = late;
+  }
+  else
+  {
+    fired++;
+    lateTotal += late;
+    if(late > lateMax)
+      lateMax = late;
+  }
+}
+
+void createOnce();
+
+// the handler for all the alarms, records how late the alarm is
+void Fired()
+{
+  AlarmId id = Alarm.getTriggeredAlarmId();
+  int64_t t = nowMs();
+  long late;
+
+  if(kind[id] == kindDaily)
+    late = (long)(t % (SECS_PER_DAY * 1000LL)) - (long)Alarm.read(id) * 1000;
+  else if(kind[id] == kindWeekly)
+    late = (long)((t - (int64_t)previousSunday(t / 1000) * 1000)) - (long)Alarm.read(id) * 1000;
+  else if(kind[id] == kindMillis)
+    late = (long)(millis() - due[id]);
+  else
+    late = (long)(t - (int64_t)due[id]);
+
+  if(kind[id] == kindTimer)
+    due[id] = (t / 1000 + Alarm.read(id)) * 1000;
+  else if(kind[id] == kindMillis)
+    due[id] = millis() + Alarm.read(id);
+  else if(kind[id] == kindOnce)
+    createOnce();  // this id has been freed, start another
+
+  recordLateness(late, kind[id] == kindMillis);
+}
+
+void createTimer(time_t period)
+{
+  AlarmId id = Alarm.timerRepeat(period, Fired);
+  if(id != dtINVALID_ALARM_ID)
+  {
+    kind[id] = kindTimer;
+    due[id] = (now() + period) * 1000ULL;
+  }
+}
+
+void createOnce()
+{
+  time_t period = 1 + random() % 5000;
+  AlarmId id = Alarm.timerOnce(period, Fired);
+  if(id != dtINVALID_ALARM_ID)
+  {
+    kind[id] = kindOnce;
+    due[id] = (now() + period) * 1000ULL;
+  }
+}
+
+void createMillisTimer(unsigned long period)
+{
+  AlarmId id = Alarm.timerRepeatMs(period, Fired);
+  if(id != dtINVALID_ALARM_ID)
+  {
+    kind[id] = kindMillis;
+    due[id] = millis() + period;
+  }
+}
+
+void createDaily(time_t value)
+{
+  AlarmId id = Alarm.alarmRepeat(value, Fired);
+  if(id != dtINVALID_ALARM_ID)
+    kind[id] = kindDaily;
+}
+
+void createWeekly(timeDayOfWeek_t dow, int H, int M, int S)
+{
+  AlarmId id = Alarm.alarmRepeat(dow, H, M, S, Fired);
+  if(id != dtINVALID_ALARM_ID)
+    kind[id] = kindWeekly;
+}
+
+void benchmarkAlarms(int days)
+{
+  tmElements_t tm = { 0, 0, 0, 7, 1, 1, 2011 - 1970 };  // Saturday midnight Jan 1 2011
+  startTime = makeTime(tm);
+  setSyncProvider(requestSync, pollSync);
+  setSyncInterval(SYNC_INTERVAL);
+  setClockDiscipline(MAX_SYNC_INTERVAL);
+  now();
+
+  createTimer(7);
+  createTimer(60);
+  createTimer(300);
+  createTimer(3600);
+  for(int i = 0; i < 4; i++)
+    createOnce();
+  createMillisTimer(50);
+  createMillisTimer(1000);
+  createDaily(AlarmHMS(8,30,0));
+  createDaily(AlarmHMS(17,45,0));
+  createDaily(AlarmHMS(23,59,59));
+  createWeekly(dowSaturday, 8,30,30);
+
+  uint64_t end = days * SECS_PER_DAY * 1000000ULL;
+  while(trueMicros < end)
+  {
+    trueMicros += (1 + random() % LOOP_MS) * 1000ULL;
+
+    unsigned long before = fired + firedMillis;
+    double start = hostNanos();
+    Alarm.service();  // a single pass, Alarm.delay would keep servicing until millis() moves on
+    double ns = hostNanos() - start;
+    passes++;
+    if(fired + firedMillis == before)
+    {
+      idlePasses++;
+      idleNanos += ns;
+      if(ns > idleMaxNanos)
+        idleMaxNanos = ns;
+    }
+    else
+    {
+      firingPasses++;
+      firingNanos += ns;
+      if(ns > firingMaxNanos)
+        firingMaxNanos = ns;
+    }
+  }
+
+  printf("Replayed %d days in %lu passes with %lu syncs, drift %ld ppm\n", days, passes, syncs, driftPpm);
+  printf("idle pass ns avg %.0f max %.0f\n", idlePasses ? idleNanos / idlePasses : 0, idleMaxNanos);
+  printf("firing pass ns avg %.0f max %.0f\n", firingPasses ? firingNanos / firingPasses : 0, firingMaxNanos);
+  printf("alarms fired %lu, ms late avg %.1f max %ld\n", fired, fired ? lateTotal / fired : 0, lateMax);
+  printf("ms timers fired %lu, ms late avg %.1f max %ld\n", firedMillis, firedMillis ? lateMillisTotal / firedMillis : 0, lateMillisMax);
+  printf("early %lu, clock error at sync ms avg %.1f max %ld, estimated drift %ld ppm\n",
+         early, syncs > 1 ? syncErrorTotal / (syncs - 1) : 0, syncErrorMax, clockDrift());
+}
+
+// returns the number of days that do not survive a round trip
+unsigned long benchmarkConversions()
+{
+  static tmElements_t elements[CONVERSIONS];  // what makeTime is timed on
+  tmElements_t tm;
+  time_t t = 0;
+  unsigned long errors = 0;
+  volatile time_t sink = 0;
+
+  double start = hostNanos();
+  for(long i = 0; i < CONVERSIONS; i++)
+  {
+    breakTime(t, elements[i]);
+    t += CONVERSION_STEP;
+  }
+  double breakNanos = hostNanos() - start;
+
+  start = hostNanos();
+  for(long i = 0; i < CONVERSIONS; i++)
+    sink = sink + makeTime(elements[i]);
+  double makeNanos = hostNanos() - start;
+
+  // every day, at a different time of day each time
+  for(unsigned long day = 0; day < 0xffffffffUL / SECS_PER_DAY; day++)  // the last day is not complete
+  {
+    t = day * SECS_PER_DAY + (day * 7919) % SECS_PER_DAY;
+    breakTime(t, tm);
+    if(makeTime(tm) != t)
+    {
+      if(errors++ < 5)
+        printf("round trip failed for %lu\n", (unsigned long)t);
+    }
+  }
+
+  printf("breakTime ns %.1f, makeTime ns %.1f, round trip errors %lu\n",
+         breakNanos / CONVERSIONS, makeNanos / CONVERSIONS, errors);
+  return errors;
+}
+
+int main(int argc, char **argv)
+{
+  int days = 7;
+  unsigned int seed = 42;  // the same alarms every run
+  for(int i = 1; i + 1 < argc; i += 2)
+  {
+    if(strcmp(argv[i], "--days") == 0)
+      days = atoi(argv[i + 1]);
+    else if(strcmp(argv[i], "--drift") == 0)
+      driftPpm = atol(argv[i + 1]);
+    else if(strcmp(argv[i], "--seed") == 0)
+      seed = atoi(argv[i + 1]);
+    else
+    {
+      fprintf(stderr, "usage: %s [--days N] [--drift PPM] [--seed N]\n", argv[0]);
+      return 2;
+    }
+  }
+  srandom(seed);
+
+  unsigned long errors = benchmarkConversions();
+  benchmarkAlarms(days);
+  return errors ? 1 : 0;
+}
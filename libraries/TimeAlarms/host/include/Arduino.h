@@ -0,0 +1,17 @@
+// The parts of the Arduino core that Time and TimeAlarms use, for the host build.
+// millis() and micros() run on the virtual clock of the program they are linked into.
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+#endif
@@ -5,3 +5,39 @@
 #endif
 
 #include "eeprom_dict.h"
+
+EEPD EEPROMDict;
+
+void test_eeprom() {
+    EEPD::reset_eeprom();
+
+    int v1;
+
+    EEPROMDict.map("hi", &v1);
+    EEPROMDict.map("hey", &v1);
+    EEPROMDict.map("hi!", &v1);
+    EEPROMDict.map("", &v1);
+    EEPROMDict.map("bleh", &v1);
+    EEPROMDict.map("asljkdlsadfj", &v1);
+    EEPROMDict.initialize();
+
+    /*
+    EEPROMDict.write("hi", ULONG_MAX);
+    unsigned long got;
+    EEPROMDict.read("hi", &got);
+    Serial.print("got: ");
+    Serial.print(got);
+    Serial.print(" ");
+    Serial.println(ULONG_MAX);
+    */
+
+    /*
+      EEPROMDict.write("hey", DBL_MAX);
+      double git;
+      EEPROMDict.read("hi", &git);
+      Serial.print("git: ");
+      Serial.print(git);
+      Serial.print(" ");
+      Serial.println(DBL_MAX);
+    */
+}
@@ -31,31 +31,32 @@ class EEPD {
     };
 
     static void write(unsigned int addr, uint8_t size, byte *var) {
-        if (addr + size > EEP_MAX_ADDR) {
+        if (addr + size - 1 > EEP_MAX_ADDR) {
             Serial.println(F("Cannot write variable: region outside EEPROM"));
             return;
         }
+        // only the bytes that changed are written, each cell wears out after about 100,000 writes
         for (int i=0; i<size; i++) {
-            eeprom_write_byte((unsigned char *) (addr + i), (uint8_t) var[i]);
+            eeprom_update_byte((unsigned char *) (uintptr_t) (addr + i), (uint8_t) var[i]);
         }
     }
 
     static void read(unsigned int addr, uint8_t size, byte *var) {
-        if (addr + size > EEP_MAX_ADDR) {
+        if (addr + size - 1 > EEP_MAX_ADDR) {
             Serial.println(F("Cannot read variable: region outside EEPROM"));
             for (int i = 0; i < size; i++)
                 var[i] = (byte)0;
             return;
         }
         for (int i=0; i<size; i++) {
-            var[i] = (byte)eeprom_read_byte((unsigned char *) (addr + i));
+            var[i] = (byte)eeprom_read_byte((unsigned char *) (uintptr_t) (addr + i));
         }
     }
 
     static uint16_t hash(const String& s) {
         // Use a CRC-16 implementation
         uint16_t h = 0xffff;
-        for (int i = 0; i < s.length(); i++)
+        for (unsigned int i = 0; i < s.length(); i++)
             h = _crc16_update(h, (uint8_t) *(s.c_str() + i));
         return h;
     }
@@ -215,40 +216,8 @@ class EEPD {
     }
 };
 
-EEPD EEPROMDict;
-
-void test_eeprom() {
-    EEPD::reset_eeprom();
-
-    int v1;
-
-    EEPROMDict.map("hi", &v1);
-    EEPROMDict.map("hey", &v1);
-    EEPROMDict.map("hi!", &v1);
-    EEPROMDict.map("", &v1);
-    EEPROMDict.map("bleh", &v1);
-    EEPROMDict.map("asljkdlsadfj", &v1);
-    EEPROMDict.initialize();
-
-    /*
-    EEPROMDict.write("hi", ULONG_MAX);
-    unsigned long got;
-    EEPROMDict.read("hi", &got);
-    Serial.print("got: ");
-    Serial.print(got);
-    Serial.print(" ");
-    Serial.println(ULONG_MAX);
-    */
-
-    /*
-      EEPROMDict.write("hey", DBL_MAX);
-      double git;
-      EEPROMDict.read("hi", &git);
-      Serial.print("git: ");
-      Serial.print(git);
-      Serial.print(" ");
-      Serial.println(DBL_MAX);
-    */
-}
+extern EEPD EEPROMDict;
+
+void test_eeprom();
 
 #endif